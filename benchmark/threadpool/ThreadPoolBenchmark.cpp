@@ -1,8 +1,11 @@
+#include <algorithm>
 #include <vector>
 #include <future>
+#include <numeric>
 #include <thread>
 #include <random>
 #include <nanobench.h>
+#include "Parallel.h"
 #include "ThreadPool.h"
 
 using namespace server::threadpool;
@@ -55,6 +58,86 @@ void benchmarkThreadPool(ThreadPool& pool, int numTasks, int matrixSize, std::st
     });
 }
 
+void benchmarkParallelFor(ThreadPool& pool, int numTasks, int matrixSize, std::string title) {
+    ankerl::nanobench::Bench bench;
+    bench.timeUnit(1ms, "ms");
+    bench.title(title);
+    bench.run("Matrix Multiplication (ParallelFor)", [&] {
+        ParallelFor(pool, 0, numTasks, 1, [matrixSize] (int) {
+            matrixMultiplication(matrixSize);
+        });
+    });
+}
+
+void benchmarkReduce(ThreadPool& pool, std::size_t size) {
+    std::vector<long> data(size);
+    std::iota(data.begin(), data.end(), 0);
+    std::size_t chunks = pool.Size() * 4;
+
+    ankerl::nanobench::Bench bench;
+    bench.title("sum of " + std::to_string(size) + " elements");
+    bench.run("futures per chunk", [&] {
+        std::vector<std::future<long>> futures;
+        std::size_t step = (size + chunks - 1) / chunks;
+        for (std::size_t lo = 0; lo < size; lo += step) {
+            futures.push_back(pool.EnqueueTask([&data, lo, hi = std::min(size, lo + step)] {
+                return std::accumulate(data.begin() + lo, data.begin() + hi, 0L);
+            }));
+        }
+        long sum = 0;
+        for (auto& future : futures) {
+            sum += future.get();
+        }
+        ankerl::nanobench::doNotOptimizeAway(sum);
+    });
+    bench.run("ParallelReduce", [&] {
+        long sum = ParallelReduce(pool, std::size_t(0), size, 0, 0L,
+                                  [&data] (std::size_t i) { return data[i]; },
+                                  [] (long a, long b) { return a + b; });
+        ankerl::nanobench::doNotOptimizeAway(sum);
+    });
+}
+
+void benchmarkSort(ThreadPool& pool, std::size_t size) {
+    std::mt19937 gen(42);
+    std::vector<int> input(size);
+    for (auto& value : input) {
+        value = static_cast<int>(gen());
+    }
+
+    ankerl::nanobench::Bench bench;
+    bench.timeUnit(1ms, "ms");
+    bench.title("sort of " + std::to_string(size) + " elements");
+    bench.run("std::sort", [&] {
+        auto data = input;
+        std::sort(data.begin(), data.end());
+        ankerl::nanobench::doNotOptimizeAway(data.front());
+    });
+    bench.run("ParallelSort", [&] {
+        auto data = input;
+        ParallelSort(pool, data.begin(), data.end());
+        ankerl::nanobench::doNotOptimizeAway(data.front());
+    });
+}
+
+// Round trip of an empty task through an idle pool: dominated by how fast a
+// waiting worker notices new work.
+void benchmarkWakeup() {
+    ThreadPoolConfig parked = {4, 4, 0};
+    ThreadPoolConfig spinning = parked;
+    spinning.spin_count = 256;
+    spinning.yield_count = 8;
+
+    ankerl::nanobench::Bench bench;
+    bench.title("empty task round trip");
+    for (auto& [name, config] : {std::make_pair("park", parked), std::make_pair("spin-then-park", spinning)}) {
+        ThreadPool wakeupPool(config);
+        bench.run(name, [&] {
+            wakeupPool.EnqueueTask([] {}).get();
+        });
+    }
+}
+
 int main() {
     std::vector<std::pair<std::size_t, std::size_t>> args = {
         {8, 1000'00}, {64, 75'000}, {256, 50'000}, {512, 35'000}, {1024, 25'000}};
@@ -63,7 +146,12 @@ int main() {
                                "x" + std::to_string(array_size);
 
         benchmarkThreadPool(pool, array_size, iterations, bench_title);
+        benchmarkParallelFor(pool, array_size, iterations, bench_title);
     }
 
+    benchmarkReduce(pool, 10'000'000);
+    benchmarkSort(pool, 10'000'000);
+    benchmarkWakeup();
+
     return 0;
 }
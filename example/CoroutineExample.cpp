@@ -0,0 +1,87 @@
+#include "server/logging/Logging.h"
+#include "server/reactor/Channel.h"
+#include "server/reactor/Dispatcher.h"
+#include "server/threadpool/Coroutine.h"
+#include "server/threadpool/ThreadPool.h"
+#include "server/TcpServer.h"
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace server::reactor;
+using namespace server::tcp;
+using namespace server::threadpool;
+using namespace std::chrono_literals;
+
+Coroutine<std::string> Process(std::string request)
+{
+    // Hop onto a worker for the CPU part, then pretend a backend takes a while.
+    co_await ThreadPool::GetGlobalThreadPool().Schedule(Priority::LOW);
+    co_await SleepFor(10ms);
+    co_return "echo: " + request;
+}
+
+// Straight-line per-connection protocol: no callbacks, no blocked thread.
+Coroutine<> Session(std::shared_ptr<Channel> channel)
+{
+    while ( true ) {
+        auto request = co_await channel->ReadSome();
+        if ( request.empty() )
+            break;
+        auto response = co_await Process(std::move(request));
+        if ( !co_await channel->WriteAll(std::move(response)) )
+            break;
+    }
+    std::cout << "session { FD: " << channel->GetHandle() << " } finished\n";
+}
+
+int main (int argc, char *argv[]) {
+
+    server::log::InitializeLogger();
+
+    GlobalThreadPoolConfig.min_core_thread = 3;
+
+    // `CoroutineExample <seconds> uring` serves through io_uring completions.
+    if ( argc > 2 && std::string(argv[2]) == "uring" )
+        Demultiplexer::DEFAULT_BACKEND = Demultiplexer::Backend::IO_URING;
+
+    // One loop per listener; SO_REUSEPORT lets the kernel spread the
+    // connections, and each loop serves the ones it accepted.
+    constexpr int LOOPS = 2;
+    Dispatcher dispatcher;
+    dispatcher.EnableSlave(true);
+    // Sessions only touch the socket on their loop; Process() hops to the pool.
+    dispatcher.SetInlineIo(true);
+    dispatcher.SetConnectionCallback([] (std::shared_ptr<Channel> channel) { Spawn(Session(std::move(channel))); });
+
+    Address addr("127.0.0.1", 9090);
+    std::vector<std::unique_ptr<TcpServer>> listeners;
+    for ( int i = 0; i < LOOPS; ++i )
+    {
+        auto server = std::make_unique<TcpServer>();
+        server->Init();
+        server->ReuseAddress(1);
+        server->ReusePort(1);
+        if ( server->Bind(addr) < 0 || server->Listen() < 0 )
+        {
+            std::cout << "failed to listen on " << addr.GetIP() << ":" << addr.GetPort() << "\n";
+            return -1;
+        }
+        dispatcher.AddSlaveListener(server->GetFd());
+        listeners.push_back(std::move(server));
+    }
+
+    auto before = dispatcher.SlaveStats();
+    std::this_thread::sleep_for(std::chrono::seconds(argc > 1 ? std::stoi(argv[1]) : 30));
+    auto after = dispatcher.SlaveStats();
+    for ( std::size_t i = 0; i < after.size(); ++i )
+        std::cout << "loop " << i << ": accepted " << after[i].accepted << ", open " << after[i].connections
+                  << ", " << Dispatcher::EventRate(before[i], after[i]) << " events/s\n";
+    dispatcher.Shutdown();
+
+    return 0;
+}
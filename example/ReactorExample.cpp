@@ -93,12 +93,13 @@ int main (int argc, char *argv[]) {
     sleep(10); // Simulate waiting for connection
     while ( !dispatcher.Stop() )
     {
-        auto ret = center.HandleReadyData(GetRequest);
+        auto ret = center.HandleReadyDataAsync(GetRequest);
         for ( auto & future : ret )
         {
-            auto request = future.get();
-            std::cout << "{ FD: " << request.GetFD() << ", Data: " << request.GetData() << " }\n";
-            center.NotifyResponseReady(request.GetFD(), "hello, client, thank you for your message.");
+            future.Then([&center] (Request request) {
+                std::cout << "{ FD: " << request.GetFD() << ", Data: " << request.GetData() << " }\n";
+                center.NotifyResponseReady(request.GetFD(), "hello, client, thank you for your message.");
+            });
         }
     }
 
@@ -83,7 +83,17 @@ public:
         if ( !_access )
             return -1;
 
-        return ::setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, static_cast<int *>(&opt), sizeof(opt) );
+        return ::setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, static_cast<int *>(&opt), sizeof(opt) );
+    }
+
+    // Lets several sockets bind the same address and port; the kernel then
+    // balances incoming connections across them. Set before Bind().
+    int ReusePort(int opt)
+    {
+        if ( !_access )
+            return -1;
+
+        return ::setsockopt(_fd, SOL_SOCKET, SO_REUSEPORT, static_cast<int *>(&opt), sizeof(opt) );
     }
 
     int DisableNagle(int opt)
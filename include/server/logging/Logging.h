@@ -28,6 +28,13 @@
             ? (void)0               \
             : server::log::internal::Voidfy() & LOG(level)
 
+// LOG for per-I/O tracing on hot paths: compiled out when NDEBUG is set.
+#ifdef NDEBUG
+#define DLOG(level) LOG_IF(level, false)
+#else
+#define DLOG(level) LOG(level)
+#endif
+
 namespace server {
 namespace log {
 
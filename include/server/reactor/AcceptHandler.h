@@ -5,6 +5,7 @@
 #include "server/logging/Logging.h"
 #include "Handler.h"
 #include <arpa/inet.h>
+#include <cerrno>
 #include <cstdint>
 #include <cstring>
 #include <fcntl.h>
@@ -12,45 +13,99 @@
 #include <netinet/in.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
 
 namespace server {
 namespace reactor {
 
+// Accepts on a listening socket. Every EPOLLIN drains the backlog, since
+// with an edge-triggered registration the next edge only comes with the
+// next connection. The listener is meant to be registered with
+// EPOLLEXCLUSIVE, so a socket shared by several loops or processes wakes
+// one of them per connection rather than all.
 class AcceptHandler : public Handler
 {
+public:
+    struct Peer
+    {
+        int fd;
+        struct sockaddr_storage addr;
+        socklen_t len;
+    };
+
 public:
     AcceptHandler(int fd)
-        : _accepted(-1)
+        : _accepted()
             , _master(fd)
-    {}
+            , _reserve(OpenReserve())
+            , _stalled(false)
+    {
+        // Draining stops at EAGAIN, which a blocking listener never returns.
+        int flags = fcntl(_master, F_GETFL, 0);
+        if ( flags >= 0 && !( flags & O_NONBLOCK ) )
+            fcntl(_master, F_SETFL, flags | O_NONBLOCK);
+    }
 
-    AcceptHandler(AcceptHandler &&) = default;
-    AcceptHandler(const AcceptHandler &) = default;
-    AcceptHandler & operator=(AcceptHandler &&) = default;
-    AcceptHandler & operator=(const AcceptHandler &) = default;
-    ~AcceptHandler() {}
+    AcceptHandler(AcceptHandler &&) = delete;
+    AcceptHandler(const AcceptHandler &) = delete;
+    AcceptHandler & operator=(AcceptHandler &&) = delete;
+    AcceptHandler & operator=(const AcceptHandler &) = delete;
+    ~AcceptHandler()
+    {
+        if ( _reserve >= 0 )
+            ::close(_reserve);
+    }
 
     void HandleEvent(uint32_t event) override
     {
-        if ( event & EPOLLIN )
-        {
-            struct sockaddr_in addr;
-            std::memset(&addr, 0, sizeof(addr));
-            socklen_t len = sizeof(addr);
-
-            _accepted = ::accept(_master, (struct sockaddr *) &addr, &len);
-            LOG_IF(ERROR, _accepted < 0) << "Failed to accept new connection.";
-
-            char ip_str[INET_ADDRSTRLEN];
-            uint16_t port = 0;
-            GetPeerHostInfo(ip_str, INET_ADDRSTRLEN, _accepted, port);
-            LOG(INFO) << "Accecpting new connection: { FD = " << _accepted << ", IP = " << ip_str << ", PORT = " << port << " }.";
-
-            int flags = fcntl(_accepted, F_GETFL, 0);
-            fcntl(_accepted, F_SETFL, flags | O_NONBLOCK);
+        _accepted.clear();
+        _stalled = false;
+        if ( !( event & EPOLLIN ) )
+            return;
+        while ( true ) {
+            Peer peer;
+            peer.len = sizeof(peer.addr);
+            peer.fd = ::accept4(_master, reinterpret_cast<struct sockaddr *>(&peer.addr), &peer.len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if ( peer.fd >= 0 ) {
+                if ( peer.addr.ss_family == AF_INET ) {
+                    auto in = reinterpret_cast<struct sockaddr_in *>(&peer.addr);
+                    char ip_str[INET_ADDRSTRLEN];
+                    inet_ntop(AF_INET, &in->sin_addr, ip_str, sizeof(ip_str));
+                    LOG(INFO) << "Accecpting new connection: { FD = " << peer.fd << ", IP = " << ip_str << ", PORT = " << ntohs(in->sin_port) << " }.";
+                }
+                _accepted.push_back(peer);
+                continue;
+            }
+            if ( errno == EINTR || errno == ECONNABORTED )
+                continue;
+            if ( errno == EMFILE || errno == ENFILE ) {
+                if ( Shed() )
+                    continue;
+                _stalled = true;
+            }
+            LOG_IF(ERROR, errno != EAGAIN && errno != EWOULDBLOCK) << "Failed to accept new connection: " << std::strerror(errno);
+            break;
         }
     }
 
+    // Out of descriptors: the pending connection would stay ready and be
+    // reported again and again. Frees the reserve fd to accept it and close
+    // it right away, so the client sees a reset instead of a hang. False if
+    // there is no reserve to spend.
+    bool Shed()
+    {
+        if ( _reserve < 0 )
+            return false;
+        ::close(_reserve);
+        auto fd = ::accept(_master, nullptr, nullptr);
+        if ( fd >= 0 )
+            ::close(fd);
+        _reserve = OpenReserve();
+        LOG_IF(WARN, fd >= 0) << "Out of file descriptors, dropped a pending connection on listener { FD = " << _master << " }";
+        return fd >= 0;
+    }
+
     static void GetPeerHostInfo(char * buf, int n, int & fd, uint16_t & port)
     {
         struct sockaddr_in peer_addr;
@@ -67,11 +122,23 @@ public:
     void SetChannel(std::shared_ptr<Channel> channel) override {}
     std::shared_ptr<Channel> GetChannel() override { return nullptr; }
 
-    int getAccepted() const { return _accepted; }
+    // Connections taken by the last HandleEvent(), already non-blocking.
+    std::vector<Peer> const & GetAccepted() const { return _accepted; }
+
+    int getAccepted() const { return _accepted.empty() ? -1 : _accepted.back().fd; }
+
+    // The last HandleEvent() stopped out of descriptors with connections
+    // still pending; the caller retries later.
+    bool Stalled() const { return _stalled; }
+
+private:
+    static int OpenReserve() { return ::open("/dev/null", O_RDONLY | O_CLOEXEC); }
 
 private:
+    std::vector<Peer> _accepted;
     int _master;
-    int _accepted;
+    int _reserve; // spent by Shed()
+    bool _stalled;
 };
 
 } // namespace reactor
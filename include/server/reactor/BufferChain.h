@@ -0,0 +1,348 @@
+#ifndef BUFFERCHAIN_H
+#define BUFFERCHAIN_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+#include "SharedBuffer.h"
+
+namespace server {
+namespace reactor {
+
+// Byte queue made of fixed-size blocks. Appending fills the last block and
+// links new ones; consuming moves a read index and unlinks drained blocks,
+// so neither ever moves bytes already queued. Blocks come from a per-thread
+// pool, and an empty chain holds none. A SharedBuffer is linked as a block
+// of its own that points at its bytes, so it is queued without a copy.
+//
+// The first block of a chain keeps PREPEND_SIZE bytes free in front, so a
+// length prefix or header can be put before a message without copying it.
+class BufferChain
+{
+public:
+    constexpr static std::size_t BLOCK_BYTES = 16384;
+    constexpr static std::size_t PREPEND_SIZE = 16;
+    constexpr static std::size_t EXTRA_SIZE = 65536; // stack buffer of ReadFrom()
+    constexpr static int MAX_IOV = 64;
+    constexpr static std::size_t SHARE_MIN = 512; // smaller shared bytes are copied
+
+public:
+    BufferChain()
+        : _head(nullptr)
+          , _tail(nullptr)
+          , _size(0)
+    {}
+
+    BufferChain(BufferChain && other) noexcept
+        : _head(std::exchange(other._head, nullptr))
+          , _tail(std::exchange(other._tail, nullptr))
+          , _size(std::exchange(other._size, 0))
+    {}
+
+    BufferChain & operator=(BufferChain && other) noexcept
+    {
+        if ( this != &other ) {
+            Clear();
+            Swap(other);
+        }
+        return *this;
+    }
+
+    BufferChain(const BufferChain &) = delete;
+    BufferChain & operator=(const BufferChain &) = delete;
+    ~BufferChain() { Clear(); }
+
+    std::size_t Size() const { return _size; }
+    bool Empty() const { return _size == 0; }
+
+    void Append(char const * data, std::size_t size)
+    {
+        while ( size > 0 ) {
+            if ( !Writable(_tail) )
+                PushBack(NewBlock(_head == nullptr ? PREPEND_SIZE : 0));
+            auto n = std::min(size, BLOCK_BYTES - _tail->end);
+            std::memcpy(_tail->base + _tail->end, data, n);
+            _tail->end += n;
+            _size += n;
+            data += n;
+            size -= n;
+        }
+    }
+
+    void Append(std::string const & data) { Append(data.data(), data.size()); }
+
+    // Links the bytes of `data`, which stay referenced until consumed.
+    // Small or ownerless ones are copied: a link costs more than the copy.
+    void Append(SharedBuffer const & data)
+    {
+        if ( data.Size() < SHARE_MIN || data.Owner() == nullptr ) {
+            Append(data.Data(), data.Size());
+            return;
+        }
+        auto segment = new Segment;
+        segment->next = nullptr;
+        segment->begin = 0;
+        segment->end = data.Size();
+        segment->base = const_cast<char *>(data.Data());
+        segment->owner = data.Owner();
+        PushBack(segment);
+        _size += data.Size();
+    }
+
+    // Puts `data` in front of the readable bytes.
+    void Prepend(char const * data, std::size_t size)
+    {
+        while ( size > 0 ) {
+            if ( _head == nullptr || _head->begin == 0 || _head->owner )
+                PushFront(NewBlock(BLOCK_BYTES));
+            auto n = std::min(size, _head->begin);
+            _head->begin -= n;
+            std::memcpy(_head->base + _head->begin, data + size - n, n);
+            _size += n;
+            size -= n;
+        }
+    }
+
+    // Drops the first `size` readable bytes.
+    void Consume(std::size_t size)
+    {
+        size = std::min(size, _size);
+        _size -= size;
+        while ( _head != nullptr ) {
+            auto readable = _head->end - _head->begin;
+            if ( size < readable ) {
+                _head->begin += size;
+                return;
+            }
+            size -= readable;
+            PopFront();
+        }
+    }
+
+    // Fills `iov` with up to `max` spans of readable bytes, in order, and
+    // returns how many it filled. The spans stay valid until those bytes
+    // are consumed; appending does not move them.
+    int Peek(struct iovec * iov, int max) const
+    {
+        int count = 0;
+        for ( auto block = _head; block != nullptr && count < max; block = block->next ) {
+            if ( block->end == block->begin )
+                continue;
+            iov[count].iov_base = block->base + block->begin;
+            iov[count].iov_len = block->end - block->begin;
+            ++count;
+        }
+        return count;
+    }
+
+    // Calls `fn(char const *, std::size_t)` for every readable span.
+    template<typename Fn>
+    void ForEachSpan(Fn && fn) const
+    {
+        for ( auto block = _head; block != nullptr; block = block->next )
+            if ( block->end != block->begin )
+                fn(block->base + block->begin, block->end - block->begin);
+    }
+
+    // Copy of the first `size` readable bytes.
+    std::string ToString(std::size_t size = std::string::npos) const
+    {
+        std::string out;
+        out.reserve(std::min(size, _size));
+        ForEachSpan([&out, &size] (char const * data, std::size_t n) {
+            n = std::min(n, size - out.size());
+            out.append(data, n);
+        });
+        return out;
+    }
+
+    // One readv into the free space of the last block and a stack buffer,
+    // so a single call takes a large burst without growing the chain ahead
+    // of time. Returns what read() would.
+    ssize_t ReadFrom(int fd)
+    {
+        char extra[EXTRA_SIZE];
+        auto previous = _tail;
+        bool fresh = !Writable(_tail);
+        if ( fresh )
+            PushBack(NewBlock(_head == nullptr ? PREPEND_SIZE : 0));
+        auto writable = BLOCK_BYTES - _tail->end;
+        struct iovec iov[2];
+        iov[0].iov_base = _tail->base + _tail->end;
+        iov[0].iov_len = writable;
+        iov[1].iov_base = extra;
+        iov[1].iov_len = sizeof(extra);
+        auto n = ::readv(fd, iov, 2);
+        if ( n <= 0 ) {
+            // Nothing arrived: an idle connection keeps no block.
+            if ( fresh ) {
+                Release(_tail);
+                _tail = previous;
+                if ( previous )
+                    previous->next = nullptr;
+                else
+                    _head = nullptr;
+            }
+            return n;
+        }
+        auto got = static_cast<std::size_t>(n);
+        _tail->end += std::min(got, writable);
+        _size += std::min(got, writable);
+        if ( got > writable )
+            Append(extra, got - writable);
+        return n;
+    }
+
+    // One writev over the queued spans; consumes what the socket took.
+    ssize_t WriteTo(int fd)
+    {
+        struct iovec iov[MAX_IOV];
+        auto count = Peek(iov, MAX_IOV);
+        if ( count == 0 )
+            return 0;
+        auto n = ::writev(fd, iov, count);
+        if ( n > 0 )
+            Consume(n);
+        return n;
+    }
+
+    void Clear()
+    {
+        while ( _head != nullptr )
+            PopFront();
+        _size = 0;
+    }
+
+    void Swap(BufferChain & other) noexcept
+    {
+        std::swap(_head, other._head);
+        std::swap(_tail, other._tail);
+        std::swap(_size, other._size);
+    }
+
+private:
+    // Readable bytes are base[begin, end). A block owns them; a linked
+    // SharedBuffer keeps its owner instead.
+    struct Segment
+    {
+        Segment * next;
+        std::size_t begin;
+        std::size_t end;
+        char * base;
+        std::shared_ptr<void const> owner;
+    };
+
+    struct Block : Segment
+    {
+        char data[BLOCK_BYTES];
+    };
+
+    // Blocks kept per thread for reuse; chains may free them on another
+    // thread than the one that took them, which just moves them over.
+    struct BlockCache
+    {
+        constexpr static std::size_t CAPACITY = 64;
+
+        std::vector<Block *> blocks;
+
+        ~BlockCache()
+        {
+            gone = true;
+            for ( auto block : blocks )
+                delete block;
+        }
+
+        // Set once the thread's cache is destroyed; chains that outlive it,
+        // e.g. in static objects, free their blocks directly.
+        inline static thread_local bool gone = false;
+    };
+
+    static BlockCache & Cache()
+    {
+        thread_local BlockCache cache;
+        return cache;
+    }
+
+    static Block * NewBlock(std::size_t offset)
+    {
+        Block * block = nullptr;
+        if ( !BlockCache::gone ) {
+            auto & cache = Cache();
+            if ( !cache.blocks.empty() ) {
+                block = cache.blocks.back();
+                cache.blocks.pop_back();
+            }
+        }
+        if ( block == nullptr )
+            block = new Block;
+        block->next = nullptr;
+        block->begin = block->end = offset;
+        block->base = block->data;
+        return block;
+    }
+
+    static void Release(Segment * segment)
+    {
+        if ( segment->owner ) {
+            delete segment;
+            return;
+        }
+        auto block = static_cast<Block *>(segment);
+        if ( !BlockCache::gone ) {
+            auto & cache = Cache();
+            if ( cache.blocks.size() < BlockCache::CAPACITY ) {
+                cache.blocks.push_back(block);
+                return;
+            }
+        }
+        delete block;
+    }
+
+    static bool Writable(Segment const * segment)
+    {
+        return segment != nullptr && !segment->owner && segment->end < BLOCK_BYTES;
+    }
+
+    void PushBack(Segment * block)
+    {
+        if ( _tail )
+            _tail->next = block;
+        else
+            _head = block;
+        _tail = block;
+    }
+
+    void PushFront(Segment * block)
+    {
+        block->next = _head;
+        _head = block;
+        if ( _tail == nullptr )
+            _tail = block;
+    }
+
+    void PopFront()
+    {
+        auto block = _head;
+        _head = block->next;
+        if ( _head == nullptr )
+            _tail = nullptr;
+        Release(block);
+    }
+
+private:
+    Segment * _head;
+    Segment * _tail;
+    std::size_t _size;
+};
+
+} // namespace reactor
+} // namespace server
+
+#endif // !BUFFERCHAIN_H
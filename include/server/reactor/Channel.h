@@ -1,44 +1,76 @@
 #ifndef CHANNEL_H
 #define CHANNEL_H
 
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
 #include <cerrno>
+#include <chrono>
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <functional>
+#include <memory>
 #include <mutex>
 #include <netinet/in.h>
 #include <string>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include "BufferChain.h"
 #include "Demultiplexer.h"
 #include "Handler.h"
+#include "SharedBuffer.h"
 #include "server/logging/Logging.h"
-#include "server/reactor/AcceptHandler.h"
+#include "server/threadpool/Task.h"
 
 namespace server {
 namespace reactor {
 
-class Channel {
+class Channel : public std::enable_shared_from_this<Channel> {
 public:
-    constexpr static std::size_t BUFSIZE = 128;
-
     typedef std::function<void(int)> DataReadyNotifaction;
     typedef std::function<void(int)> ClosedNotifaction;
     typedef std::function<void(int receivedBytes, int err, std::string data)> ReceiveCB;
     typedef std::function<void(int sentBytes, int err, std::string data)> SendCB;
     typedef std::function<void(int)> ClosedCb;
 
+    // A zero duration disables that timeout.
+    struct Timeouts
+    {
+        std::chrono::milliseconds idle;  // no traffic in either direction
+        std::chrono::milliseconds read;  // first byte of a request until a response is queued
+        std::chrono::milliseconds write; // queued response not yet flushed to the socket
+    };
+
 public:
+    // Takes ownership of `fd`: it is closed with the last reference to the
+    // channel, so no worker still holding one can touch a reused fd.
     Channel(int fd, Demultiplexer * const ptr = nullptr)
         : _fd(fd)
           , _active(fd > 0 ? true : false)
-          , _receivedCount(0)
-          , _sendingBuf(BUFSIZE, '-')
-          , _receivedBuf(BUFSIZE, '-')
+          , _sendingBuf()
+          , _receivedBuf()
           , _sendMutex()
           , _receiveMutex()
+          , _sendIov()
+          , _sendMsg()
+          , _sending(false)
           , _demultiplexer(ptr)
+          , _eventData(nullptr)
+          , _readWaiter()
+          , _writeWaiter()
+          , _idleTimeout(0)
+          , _readTimeout(0)
+          , _writeTimeout(0)
+          , _lastActive(Now())
+          , _readSince(0)
+          , _writeSince(0)
+          , _timeoutTimer(0)
+          , _peer()
+          , _generation(0)
     {
-        _sendingBuf.clear();
+        SetTimeouts(_defaultTimeouts);
     }
     Channel(Channel &&) = delete;
     Channel(const Channel &) = delete;
@@ -50,118 +82,456 @@ public:
         _demultiplexer = nullptr;
         DisableSend();
         DisableReceive();
+        if ( _fd > 0 )
+            ::close(_fd);
     };
 
     void Read()
     {
         if ( !_active )
             return;
-        int got = 0;
+        ssize_t got = 0;
         {
             std::lock_guard<std::mutex> lk(_receiveMutex);
-            auto validSize = _receivedBuf.capacity() - _receivedCount;
-            do {
-                if ( validSize == got )
-                    _receivedBuf.reserve(1.5 * _receivedBuf.capacity());
-                _receivedCount += got;
-                validSize = _receivedBuf.capacity() - _receivedCount;
-            } while ( ( got = ::read(_fd, _receivedBuf.data() + _receivedCount, validSize) ) > 0 );
+            auto before = _receivedBuf.Size();
+            while ( ( got = _receivedBuf.ReadFrom(_fd) ) > 0 ) ;
+            if ( _receivedBuf.Size() > before ) {
+                auto now = Now();
+                _lastActive.store(now, std::memory_order_relaxed);
+                int64_t none = 0;
+                _readSince.compare_exchange_strong(none, now, std::memory_order_relaxed);
+            }
             if ( _globalReceivedCb )
-                _globalReceivedCb(_receivedCount, errno, _receivedBuf.substr(0, _receivedCount));
-            char ip_str[INET_ADDRSTRLEN];
-            uint16_t port = 0;
-            AcceptHandler::GetPeerHostInfo(ip_str, INET_ADDRSTRLEN, _fd, port);
-            LOG(INFO) << "Has been read data { FD = " << _fd << ", IP = " << ip_str << ", PORT = " << port << ", Total Size For Received Data: " << _receivedCount << ", Bufferring Data: " << _receivedBuf.substr(0, _receivedCount) << " }";
+                _globalReceivedCb(_receivedBuf.Size(), errno, _receivedBuf.ToString());
+            DLOG(INFO) << "Has been read data { FD = " << _fd << ", PEER = " << PeerAddress() << ", Total Size For Received Data: " << _receivedBuf.Size() << " }";
         }
         if ( got == 0 )
         {
-            DisableReceive();
-            DisableSend();
-            Inactive();
-            if ( _closedNotify )
-                _closedNotify(_fd);
+            PeerClosed();
             return;
         }
-        if ( _dataReadyNotify )
+        NotifyReceived();
+    }
+
+    // Appends bytes a completion backend has already received for us.
+    void Received(char const * data, std::size_t size)
+    {
+        if ( !_active || size == 0 )
+            return;
+        std::lock_guard<std::mutex> lk(_receiveMutex);
+        _receivedBuf.Append(data, size);
+        auto now = Now();
+        _lastActive.store(now, std::memory_order_relaxed);
+        int64_t none = 0;
+        _readSince.compare_exchange_strong(none, now, std::memory_order_relaxed);
+        if ( _globalReceivedCb )
+            _globalReceivedCb(_receivedBuf.Size(), 0, _receivedBuf.ToString());
+        DLOG(INFO) << "Has been received data { FD = " << _fd << ", PEER = " << PeerAddress() << ", Total Size For Received Data: " << _receivedBuf.Size() << " }";
+    }
+
+    // Hands buffered data to a suspended ReadSome(), which consumes it
+    // itself, or else to the data-ready hook. Two events for the fd may be
+    // handled at once, and the one that finds nothing new must not wake a
+    // reader the other has already served: it would see an empty buffer,
+    // which means end of stream.
+    void NotifyReceived()
+    {
+        threadpool::Task waiter;
+        bool parked;
+        {
+            std::lock_guard<std::mutex> lk(_receiveMutex);
+            parked = static_cast<bool>(_readWaiter);
+            if ( parked && !_receivedBuf.Empty() )
+                waiter = std::move(_readWaiter);
+        }
+        if ( waiter )
+            waiter();
+        else if ( !parked && _dataReadyNotify )
             _dataReadyNotify(_fd);
     }
 
+    void PeerClosed()
+    {
+        DisableReceive();
+        DisableSend();
+        Inactive();
+        if ( _closedNotify )
+            _closedNotify(_fd);
+    }
+
+    // Result of the send StartSend() submitted, on the loop owning the
+    // channel: a short send goes out again ahead of anything queued since.
+    void SendDone(int res)
+    {
+        threadpool::Task waiter;
+        {
+            std::lock_guard<std::mutex> lk(_sendMutex);
+            _sending = false;
+            if ( res > 0 ) {
+                if ( _globalSentCb )
+                    _globalSentCb(res, 0, _sendingBuf.ToString(res));
+                _sendingBuf.Consume(res);
+                Sent(_sendingBuf.Empty());
+                StartSend(_demultiplexer.load(std::memory_order_acquire));
+            } else {
+                LOG(ERROR) << "Failed to send { FD = " << _fd << ", ERROR = " << std::strerror(-res) << " }";
+                _sendingBuf.Clear();
+            }
+            if ( !_sending )
+                waiter = std::move(_writeWaiter);
+        }
+        if ( waiter )
+            waiter();
+    }
+
     void Write()
     {
         if ( !_active )
             return;
-        std::lock_guard<std::mutex> lk(_sendMutex);
-        auto size = _sendingBuf.size();
+        threadpool::Task waiter;
+        {
+            std::lock_guard<std::mutex> lk(_sendMutex);
+            WriteLocked();
+            if ( _sendingBuf.Empty() )
+                waiter = std::move(_writeWaiter);
+        }
+        if ( waiter )
+            waiter();
+    }
+
+    // Awaitable returning whatever was received since the last read, waiting
+    // for the next readiness event if nothing is buffered. Empty once the
+    // peer has closed. Resumes on the thread handling the event.
+    class ReadAwaiter
+    {
+    public:
+        explicit ReadAwaiter(Channel & channel)
+            : _channel(channel)
+        {}
+
+        bool await_ready() const noexcept { return false; }
+
+        template<typename Handle>
+        bool await_suspend(Handle handle) { return _channel.SuspendReader([handle] () mutable { handle.resume(); }); }
+
+        std::string await_resume() { return _channel.TakeReceivedData(); }
+
+    private:
+        Channel & _channel;
+    };
+
+    // Awaitable queueing `data` and resuming once the send buffer has been
+    // flushed to the socket. Yields false if the connection went away first.
+    class WriteAwaiter
+    {
+    public:
+        WriteAwaiter(Channel & channel, std::string data)
+            : _channel(channel)
+              , _data(std::move(data))
+        {}
+
+        bool await_ready() const noexcept { return false; }
+
+        template<typename Handle>
+        bool await_suspend(Handle handle) { return _channel.SuspendWriter(_data, [handle] () mutable { handle.resume(); }); }
+
+        bool await_resume() const { return _channel.Active(); }
+
+    private:
+        Channel & _channel;
+        std::string _data;
+    };
+
+    ReadAwaiter ReadSome() { return ReadAwaiter(*this); }
+    WriteAwaiter WriteAll(std::string data) { return WriteAwaiter(*this, std::move(data)); }
+
+private:
+    void WriteLocked()
+    {
+        auto size = _sendingBuf.Size();
         if ( size < 1 )
         {
-            auto events = _demultiplexer->GetEvents();
-            _demultiplexer->ModifyEvent(_fd, events & ~EPOLLOUT);
+            Rearm(0, EPOLLOUT);
             return;
         }
-        auto sent = ::write(_fd, _sendingBuf.data(), size);
-
-        char ip_str[INET_ADDRSTRLEN];
-        uint16_t port = 0;
-        AcceptHandler::GetPeerHostInfo(ip_str, INET_ADDRSTRLEN, _fd, port);
-        LOG(INFO) << "Has been read data { FD = " << _fd << ", IP = " << ip_str << ", PORT = " << port << ", Buffering Data: " << _sendingBuf << ", Sent DATA: " << _sendingBuf.substr(0, sent) << " }";
+        std::string pending;
+        if ( _globalSentCb )
+            pending = _sendingBuf.ToString();
+        auto sent = _sendingBuf.WriteTo(_fd);
+        auto error = sent < 0 ? errno : 0;
+        DLOG(INFO) << "Has been sent data { FD = " << _fd << ", PEER = " << PeerAddress() << ", Buffering Size: " << size << ", Sent Size: " << sent << " }";
 
         if ( sent > 0 && _globalSentCb )
-            _globalSentCb(sent, errno, _sendingBuf.substr(0, sent));
+            _globalSentCb(sent, errno, pending.substr(0, sent));
         if ( sent > 0 ) {
-            _sendingBuf.erase(0 , sent);
+            Sent(_sendingBuf.Empty());
         } else if ( sent == 0 ) {
-            if ( _demultiplexer )
-                _demultiplexer->ModifyEvent(_fd, _demultiplexer->GetEvents());
+            Rearm(0, 0);
+        } else if ( error == EAGAIN || error == EWOULDBLOCK || error == EINTR ) {
+            // No room after all, e.g. another task got there first: keep
+            // the data queued and wait for the socket to drain.
+            Rearm(EPOLLOUT, 0);
         } else {
             DisableSend();
+        }
+    }
+
+    // Returns false, so the caller does not suspend, when data is already
+    // buffered or the channel is closed.
+    bool SuspendReader(threadpool::Task resume)
+    {
+        std::lock_guard<std::mutex> lk(_receiveMutex);
+        if ( !_active || !_receivedBuf.Empty() )
+            return false;
+        _readWaiter = std::move(resume);
+        return true;
+    }
+
+    // Tries the socket first and only parks the writer on a short write.
+    bool SuspendWriter(std::string & data, threadpool::Task resume)
+    {
+        if ( !_active )
+            return false;
+        {
+            std::lock_guard<std::mutex> lk(_sendMutex);
+            if ( !SendLocked(data) )
+                return false;
+            _writeWaiter = std::move(resume);
+        }
+        Rearm(EPOLLOUT, 0);
+        return true;
+    }
+
+    // Writes straight to the socket unless data is already queued ahead,
+    // then queues whatever is left. Returns true if something was queued.
+    // A completion backend always queues; Rearm() submits the send.
+    // Called with _sendMutex held.
+    bool SendLocked(std::string const & data)
+    {
+        auto sent = WriteDirect(data.data(), data.size());
+        if ( sent < 0 )
+            return false;
+        _sendingBuf.Append(data.data() + sent, data.size() - sent);
+        return true;
+    }
+
+    // Same, but the rest is linked into the queue rather than copied.
+    bool SendLocked(SharedBuffer const & data)
+    {
+        auto sent = WriteDirect(data.Data(), data.Size());
+        if ( sent < 0 )
+            return false;
+        _sendingBuf.Append(data.Slice(sent));
+        return true;
+    }
+
+    // How much of `data` went out when nothing is queued ahead, or -1 if
+    // there is nothing left to queue. Called with _sendMutex held.
+    ssize_t WriteDirect(char const * data, std::size_t size)
+    {
+        Queued();
+        if ( !_sendingBuf.Empty() || _sending || Completions() )
+            return 0;
+        auto sent = ::write(_fd, data, size);
+        if ( sent > 0 )
+            Sent(sent == static_cast<ssize_t>(size));
+        if ( sent == static_cast<ssize_t>(size) )
+            return -1;
+        if ( sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK )
+            return -1;
+        return std::max<ssize_t>(sent, 0);
+    }
+
+    std::string TakeReceivedData()
+    {
+        std::lock_guard<std::mutex> lk(_receiveMutex);
+        std::string data = _receivedBuf.ToString();
+        _receivedBuf.Clear();
+        return data;
+    }
+
+    static threadpool::Task TakeWaiter(threadpool::Task & waiter, std::mutex & mx)
+    {
+        std::lock_guard<std::mutex> lk(mx);
+        return std::move(waiter);
+    }
+
+    // Re-arms the fd on whichever loop polls it now. A completion backend
+    // has no readiness to wait for: wanting EPOLLOUT means sending.
+    void Rearm(uint32_t add, uint32_t remove)
+    {
+        auto demultiplexer = _demultiplexer.load(std::memory_order_acquire);
+        if ( demultiplexer == nullptr )
+            return;
+        if ( demultiplexer->GetBackend() == Demultiplexer::Backend::IO_URING ) {
+            if ( add & EPOLLOUT ) {
+                std::lock_guard<std::mutex> lk(_sendMutex);
+                StartSend(demultiplexer);
+            }
             return;
         }
+        demultiplexer->ModifyEvent(_fd, ( demultiplexer->GetEvents() | add ) & ~remove, _eventData.load(std::memory_order_acquire));
+    }
+
+    bool Completions() const
+    {
+        auto demultiplexer = _demultiplexer.load(std::memory_order_acquire);
+        return demultiplexer && demultiplexer->GetBackend() == Demultiplexer::Backend::IO_URING;
+    }
+
+    // Submits the queued spans as one sendmsg unless a send is already in
+    // flight. Appending never moves queued bytes and only SendDone()
+    // consumes them, so the kernel reads them in place. Called with
+    // _sendMutex held.
+    void StartSend(Demultiplexer * demultiplexer)
+    {
+        if ( _sending || _sendingBuf.Empty() || !_active || demultiplexer == nullptr )
+            return;
+        std::memset(&_sendMsg, 0, sizeof(_sendMsg));
+        _sendMsg.msg_iov = _sendIov;
+        _sendMsg.msg_iovlen = _sendingBuf.Peek(_sendIov, SEND_IOV);
+        _sending = demultiplexer->SendMsg(_fd, &_sendMsg, this, shared_from_this()) >= 0;
+    }
+
+    static int64_t Now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static int64_t ToNanos(std::chrono::milliseconds d)
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+    }
+
+    // A response is on its way: the request is answered and the write clock
+    // starts if nothing was pending. Called with _sendMutex held.
+    void Queued()
+    {
+        _readSince.store(0, std::memory_order_relaxed);
+        if ( _sendingBuf.Empty() )
+            _writeSince.store(Now(), std::memory_order_relaxed);
     }
 
-    void NotifyWriteEvent(std::string data)
+    // Called with _sendMutex held after bytes reached the socket.
+    void Sent(bool flushed)
+    {
+        _lastActive.store(Now(), std::memory_order_relaxed);
+        if ( flushed )
+            _writeSince.store(0, std::memory_order_relaxed);
+    }
+
+public:
+
+    // Writes `data` now as far as the socket takes it and leaves the rest to
+    // EPOLLOUT. Meant for the loop polling the channel (Dispatcher::Send).
+    // A SharedBuffer is never copied: what the socket does not take at once
+    // is queued by reference.
+    template<typename Data>
+    void Send(Data const & data)
     {
         if ( !_active )
             return;
+        bool queued;
         {
             std::lock_guard<std::mutex> lk(_sendMutex);
-            auto size = _sendingBuf.size();
-            auto waitToSend = data.length();
-            if ( auto capacity = _sendingBuf.capacity(); size + waitToSend >= capacity ) {
-                _sendingBuf.reserve(capacity + waitToSend);
-                _sendingBuf.insert(size, data);
-            }
-            else if ( size == 0 )
-                _sendingBuf.insert(_sendingBuf.begin(), data.begin(), data.end());
-            else
-                _sendingBuf.insert(size, data);
+            queued = SendLocked(data);
         }
+        if ( queued )
+            Rearm(EPOLLOUT, 0);
+    }
 
-        if ( _demultiplexer == nullptr )
+    template<typename Data>
+    void NotifyWriteEvent(Data const & data)
+    {
+        if ( !_active )
             return;
-        auto events = _demultiplexer->GetEvents();
-        _demultiplexer->ModifyEvent(_fd, events | EPOLLOUT);
+        {
+            std::lock_guard<std::mutex> lk(_sendMutex);
+            Queued();
+            _sendingBuf.Append(data);
+        }
+
+        Rearm(EPOLLOUT, 0);
     }
 
-    void SetDemultiplexer(Demultiplexer * const ptr) { _demultiplexer = ptr; }
+    // `data` is what the fd was registered with in epoll_event.data.ptr, kept
+    // when the channel re-arms its events; null means the fd itself. Only
+    // the loop that polls the fd switches it, while the channel may be in
+    // use: to null when the connection leaves, to its own on arrival.
+    void SetDemultiplexer(Demultiplexer * const ptr, void * data = nullptr)
+    {
+        _eventData.store(data, std::memory_order_release);
+        _demultiplexer.store(ptr, std::memory_order_release);
+    }
 
     static void SetDataReadyNotify(DataReadyNotifaction notify) { _dataReadyNotify = std::move(notify); }
     static void SetClosedNotify(ClosedNotifaction notify) { _closedNotify = std::move(notify); }
     static void SetGlobalReceiveCallback(ReceiveCB cb) { _globalReceivedCb = std::move(cb); }
     static void SetGlobalSendCallback(SendCB cb) { _globalSentCb = std::move(cb); }
     static void SetGlobalClosedCallBack(ClosedCb cb) { _globalClosedCb = std::move(cb); }
+    // Applies to channels created afterwards.
+    static void SetDefaultTimeouts(Timeouts timeouts) { _defaultTimeouts = timeouts; }
+
+    // Takes effect the next time the dispatcher checks the channel; set it
+    // from the connection callback to override the defaults from the start.
+    void SetTimeouts(Timeouts timeouts)
+    {
+        _idleTimeout.store(ToNanos(timeouts.idle), std::memory_order_relaxed);
+        _readTimeout.store(ToNanos(timeouts.read), std::memory_order_relaxed);
+        _writeTimeout.store(ToNanos(timeouts.write), std::memory_order_relaxed);
+    }
+
+    // Monotonic nanoseconds at which the channel should next be checked,
+    // 0 if every timeout is disabled. A timeout whose clock is not running
+    // counts from now, so a request starting later is caught within twice
+    // its limit. I/O only moves the stamps, whoever watches re-arms lazily.
+    int64_t Deadline() const
+    {
+        int64_t deadline = 0;
+        auto now = Now();
+        auto consider = [&deadline, now] (std::atomic<int64_t> const & since, std::atomic<int64_t> const & limit) {
+            auto start = since.load(std::memory_order_relaxed);
+            auto span = limit.load(std::memory_order_relaxed);
+            if ( span <= 0 )
+                return;
+            if ( start == 0 )
+                start = now;
+            if ( deadline == 0 || start + span < deadline )
+                deadline = start + span;
+        };
+        consider(_lastActive, _idleTimeout);
+        consider(_readSince, _readTimeout);
+        consider(_writeSince, _writeTimeout);
+        return deadline;
+    }
+
+    // The wheel timer of the loop watching the timeouts, 0 if none is
+    // armed; the loop cancels it when the connection leaves it.
+    void SetTimeoutTimer(uint64_t id) { _timeoutTimer.store(id, std::memory_order_relaxed); }
+    uint64_t TakeTimeoutTimer() { return _timeoutTimer.exchange(0, std::memory_order_relaxed); }
 
     std::string GetReceivedData()
     {
         if ( !_active )
             return {};
         std::lock_guard<std::mutex> lk(_receiveMutex);
-        if ( _receivedCount < 1 )
+        if ( _receivedBuf.Empty() )
             return {};
-        std::string data = std::move(_receivedBuf.substr(0, _receivedCount));
-        _receivedCount = 0;
+        std::string data = _receivedBuf.ToString();
+        _receivedBuf.Clear();
         return data;
     }
 
+    // Lets `fn` parse the received bytes in place, e.g. through
+    // BufferChain::Peek(); it drops what it used with Consume().
+    template<typename Fn>
+    void ParseReceived(Fn && fn)
+    {
+        std::lock_guard<std::mutex> lk(_receiveMutex);
+        fn(_receivedBuf);
+    }
+
     void DisableReceive()
     {
         if ( !_active )
@@ -178,18 +548,82 @@ public:
 
     int GetHandle() const { return _fd; }
 
+    // The fd table generation the channel was inserted at, so a reply can
+    // be addressed to this connection rather than whatever reuses its fd.
+    uint32_t Generation() const { return _generation.load(std::memory_order_acquire); }
+
+    void SetGeneration(uint32_t generation) { _generation.store(generation, std::memory_order_release); }
+
+    // Recorded once when the connection is accepted; null `peer` asks the
+    // socket.
+    void SetPeer(struct sockaddr_storage const * peer)
+    {
+        if ( peer ) {
+            _peer = *peer;
+            return;
+        }
+        socklen_t len = sizeof(_peer);
+        if ( ::getpeername(_fd, reinterpret_cast<struct sockaddr *>(&_peer), &len) < 0 )
+            _peer.ss_family = AF_UNSPEC;
+    }
+
+    // "ip:port", or empty if the peer is unknown.
+    std::string PeerAddress() const
+    {
+        char ip[INET6_ADDRSTRLEN];
+        uint16_t port;
+        if ( _peer.ss_family == AF_INET ) {
+            auto in = reinterpret_cast<struct sockaddr_in const *>(&_peer);
+            inet_ntop(AF_INET, &in->sin_addr, ip, sizeof(ip));
+            port = ntohs(in->sin_port);
+        } else if ( _peer.ss_family == AF_INET6 ) {
+            auto in6 = reinterpret_cast<struct sockaddr_in6 const *>(&_peer);
+            inet_ntop(AF_INET6, &in6->sin6_addr, ip, sizeof(ip));
+            port = ntohs(in6->sin6_port);
+        } else {
+            return {};
+        }
+        return std::string(ip) + ":" + std::to_string(port);
+    }
+
     bool Active() const{ return _active; }
-    void Inactive() { _active = false; }
+
+    // Wakes suspended readers and writers on the calling thread; call it
+    // without holding locks the resumed code may need.
+    void Inactive()
+    {
+        _active = false;
+        if ( auto waiter = TakeWaiter(_readWaiter, _receiveMutex) )
+            waiter();
+        if ( auto waiter = TakeWaiter(_writeWaiter, _sendMutex) )
+            waiter();
+    }
 
 private:
     int _fd;
-    bool _active;
-    int _receivedCount;
-    std::string _sendingBuf;
-    std::string _receivedBuf;
+    std::atomic_bool _active;
+    BufferChain _sendingBuf;
+    BufferChain _receivedBuf;
     std::mutex _sendMutex;
     std::mutex _receiveMutex;
-    Demultiplexer * _demultiplexer;
+    constexpr static int SEND_IOV = 16;
+    struct iovec _sendIov[SEND_IOV]; // of the send in flight on a completion backend
+    struct msghdr _sendMsg;
+    bool _sending;                   // guarded by _sendMutex
+    std::atomic<Demultiplexer *> _demultiplexer;
+    std::atomic<void *> _eventData;
+    threadpool::Task _readWaiter;
+    threadpool::Task _writeWaiter;
+    std::atomic<int64_t> _idleTimeout;
+    std::atomic<int64_t> _readTimeout;
+    std::atomic<int64_t> _writeTimeout;
+    std::atomic<int64_t> _lastActive;
+    std::atomic<int64_t> _readSince;  // 0 while no request is being received
+    std::atomic<int64_t> _writeSince; // 0 while the send buffer is empty
+    std::atomic<uint64_t> _timeoutTimer;
+    struct sockaddr_storage _peer;
+    std::atomic<uint32_t> _generation;
+    inline static Timeouts _defaultTimeouts = {};
     inline static DataReadyNotifaction _dataReadyNotify;
     inline static ClosedNotifaction _closedNotify;
     inline static ReceiveCB _globalReceivedCb;
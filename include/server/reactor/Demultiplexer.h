@@ -1,20 +1,67 @@
 #ifndef DEMULTIPLEXER_H
 #define DEMULTIPLEXER_H
 
+#include "IoUring.h"
 #include "server/logging/LogMessage.h"
 #include "server/logging/Logging.h"
+#include <atomic>
 #include <cstdint>
+#include <cstring>
 #include <memory>
+#include <mutex>
+#include <poll.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
 #include <unistd.h>
+#include <unordered_map>
 #include <vector>
 
 namespace server {
 namespace reactor {
 
+// Readiness through epoll, or completions through io_uring.
+//
+// With Backend::IO_URING the epoll set still exists for whatever is
+// registered with RegisterFd() (timers, foreign fds); the ring polls it and
+// WaitForEvents() reports its events as usual. Sockets handed to Accept(),
+// Receive() and Send() are not in the epoll set: their results come back
+// from GetCompletions() after WaitForEvents(), with received bytes already
+// in a buffer of the ring's provided-buffer pool. Those calls are safe from
+// any thread; the loop submits them with its next wait, in one syscall.
 class Demultiplexer {
 public:
+    enum class Backend
+    {
+        EPOLL,
+        IO_URING,
+    };
+
+    // Completed operations of the io_uring backend.
+    enum class Op : uint8_t
+    {
+        ACCEPT,
+        RECEIVE,
+        SEND,
+    };
+
+    struct Completion
+    {
+        Op op;
+        void * data;          // as passed to Accept(), Receive() or Send()
+        int32_t res;          // accepted fd, byte count or -errno
+        bool more;            // a multishot operation stays armed
+        char const * buffer;  // received bytes, valid until the next wait
+    };
+
     inline static uint32_t DEFAULT_EVENTS = EPOLLET | EPOLLIN | EPOLLHUP | EPOLLERR;
+    // Used by Demultiplexers created afterwards; IO_URING falls back to
+    // EPOLL where the kernel lacks what it needs.
+    inline static Backend DEFAULT_BACKEND = Backend::EPOLL;
+    inline static bool URING_SQPOLL = false;
+    inline static unsigned URING_ENTRIES = 256;
+    inline static unsigned URING_BUFFERS = 256; // a power of two
+    inline static unsigned URING_BUFFER_SIZE = 4096;
 
 public:
     typedef std::vector<struct epoll_event> EventsVec;
@@ -24,13 +71,27 @@ public:
     Demultiplexer()
         : _fd(-1)
           , _events(DEFAULT_EVENTS)
+          , _wakefd(-1)
+          , _wakePending(false)
+          , _backend(DEFAULT_BACKEND)
+          , _ring()
+          , _stageMx()
+          , _staged()
+          , _ops()
+          , _nextTag(FIRST_TAG)
+          , _waiting(false)
+          , _completions()
+          , _finished()
+          , _consumed()
+          , _epollBacklog(false)
+          , _closing(false)
     {
         Init();
     }
 
-    Demultiplexer(Demultiplexer &&) = default;
+    Demultiplexer(Demultiplexer &&) = delete;
     Demultiplexer(const Demultiplexer &) = delete;
-    Demultiplexer &operator=(Demultiplexer &&) = default;
+    Demultiplexer &operator=(Demultiplexer &&) = delete;
     Demultiplexer &operator=(const Demultiplexer &) = delete;
     ~Demultiplexer() { Shutdown(); }
 
@@ -38,10 +99,35 @@ public:
     {
         _fd = ::epoll_create(1);
         LOG_IF(ERROR, _fd < 0) << "Failed to create epollfd";
+        if ( _fd >= 0 ) {
+            _wakefd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            LOG_IF(ERROR, _wakefd < 0) << "Failed to create eventfd";
+        }
+        if ( _backend == Backend::IO_URING && !InitRing() ) {
+            LOG(WARN) << "io_uring is not usable here, falling back to epoll";
+            _ring.Shutdown();
+            _backend = Backend::EPOLL;
+        }
+        if ( _backend == Backend::EPOLL && _wakefd >= 0 )
+            RegisterFd(_wakefd, EPOLLIN, &_wakefd);
         return _fd;
     }
 
-    bool Valid() { return _fd; }
+    Backend GetBackend() const { return _backend; }
+
+    // Makes a WaitForEvents() blocked on another thread return. Wakeups
+    // issued before that thread gets to consume one collapse into a single
+    // eventfd write.
+    void Wakeup()
+    {
+        if ( _wakefd < 0 || _wakePending.exchange(true, std::memory_order_acq_rel) )
+            return;
+        uint64_t one = 1;
+        auto written = ::write(_wakefd, &one, sizeof(one));
+        (void) written;
+    }
+
+    bool Valid() { return _fd >= 0; }
 
     uint32_t & GetEvents() { return _events; }
     uint32_t const & SetEvents() const { return _events; }
@@ -116,7 +202,78 @@ public:
         return ret;
     }
 
-    int WaitForEvents(EventsVec & events)
+    // Multishot accept on listening socket `fd`; every connection completes
+    // as an ACCEPT with the new, non-blocking fd. `keep` is held until the
+    // operation ends, so `data` stays valid for its completions.
+    int Accept(int fd, void * data, std::shared_ptr<void> keep)
+    {
+        struct io_uring_sqe sqe;
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_ACCEPT;
+        sqe.fd = fd;
+        sqe.accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe.ioprio = IORING_ACCEPT_MULTISHOT;
+        return Stage(sqe, Op::ACCEPT, data, std::move(keep));
+    }
+
+    // Multishot receive into the provided buffers; ends with a completion
+    // whose `more` is false, e.g. on EOF (res 0) or when the pool ran dry
+    // (-ENOBUFS), after which it has to be re-armed.
+    int Receive(int fd, void * data, std::shared_ptr<void> keep)
+    {
+        struct io_uring_sqe sqe;
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_RECV;
+        sqe.fd = fd;
+        sqe.flags = IOSQE_BUFFER_SELECT;
+        sqe.buf_group = BUFFER_GROUP;
+        sqe.ioprio = IORING_RECV_MULTISHOT;
+        return Stage(sqe, Op::RECEIVE, data, std::move(keep));
+    }
+
+    // `buf` must stay untouched until the SEND completes; `keep` should own it.
+    int Send(int fd, char const * buf, std::size_t size, void * data, std::shared_ptr<void> keep)
+    {
+        struct io_uring_sqe sqe;
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_SEND;
+        sqe.fd = fd;
+        sqe.addr = reinterpret_cast<uint64_t>(buf);
+        sqe.len = static_cast<uint32_t>(size);
+        sqe.msg_flags = MSG_NOSIGNAL;
+        return Stage(sqe, Op::SEND, data, std::move(keep));
+    }
+
+    // Same for the spans of `msg`, which must stay untouched as well.
+    int SendMsg(int fd, struct msghdr const * msg, void * data, std::shared_ptr<void> keep)
+    {
+        struct io_uring_sqe sqe;
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_SENDMSG;
+        sqe.fd = fd;
+        sqe.addr = reinterpret_cast<uint64_t>(msg);
+        sqe.len = 1;
+        sqe.msg_flags = MSG_NOSIGNAL;
+        return Stage(sqe, Op::SEND, data, std::move(keep));
+    }
+
+    // Cancels every operation on `fd`; each still completes, with -ECANCELED.
+    int Cancel(int fd)
+    {
+        struct io_uring_sqe sqe;
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_ASYNC_CANCEL;
+        sqe.fd = fd;
+        sqe.cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        sqe.user_data = CANCEL_TAG;
+        return Stage(sqe);
+    }
+
+    // What the io_uring backend completed during the last WaitForEvents().
+    std::vector<Completion> const & GetCompletions() const { return _completions; }
+
+    // `timeout` in milliseconds, -1 blocks until an event arrives.
+    int WaitForEvents(EventsVec & events, int timeout = -1)
     {
         if ( !Valid() )
             return _fd;
@@ -124,7 +281,21 @@ public:
         auto size = events.size();
         if ( size  < 1 )
             return -1;
-        return epoll_wait(_fd, events.data(), size, -1);
+        if ( _backend == Backend::IO_URING )
+            return WaitForRing(events, timeout);
+        int n = epoll_wait(_fd, events.data(), size, timeout);
+        // A wakeup only has to interrupt the wait; callers never see it.
+        for ( int i = 0; i < n; ++i ) {
+            if ( events[i].data.ptr != &_wakefd )
+                continue;
+            _wakePending.store(false, std::memory_order_release);
+            uint64_t count;
+            auto got = ::read(_wakefd, &count, sizeof(count));
+            (void) got;
+            events[i] = events[--n];
+            break;
+        }
+        return n;
     }
 
     int WaitForEvents(EventsVecPtr ptr)
@@ -138,13 +309,233 @@ public:
     {
         if( !Valid() )
             return;
+        if ( _backend == Backend::IO_URING )
+            ShutdownRing();
         ::close(_fd);
         LOG(INFO) << "Close epollfd " << _fd;
+        _fd = -1;
+        if ( _wakefd >= 0 )
+            ::close(_wakefd);
+        _wakefd = -1;
+    }
+
+private:
+    // user_data of the ring's own requests; operations count up from FIRST_TAG.
+    constexpr static uint64_t EPOLL_TAG = 1;
+    constexpr static uint64_t WAKE_TAG = 2;
+    constexpr static uint64_t CANCEL_TAG = 3;
+    constexpr static uint64_t FIRST_TAG = 16;
+    constexpr static uint16_t BUFFER_GROUP = 0;
+
+    struct Pending
+    {
+        Op op;
+        void * data;
+        std::shared_ptr<void> keep;
+    };
+
+    bool InitRing()
+    {
+        if ( _fd < 0 || _wakefd < 0 || !IoUring::Supported() )
+            return false;
+        if ( !_ring.Init(URING_ENTRIES, URING_ENTRIES * 16, URING_SQPOLL) )
+            return false;
+        if ( !_ring.SetupBuffers(URING_BUFFERS, URING_BUFFER_SIZE, BUFFER_GROUP) )
+            return false;
+        PollFd(_fd, EPOLL_TAG);
+        PollFd(_wakefd, WAKE_TAG);
+        return true;
+    }
+
+    // Multishot poll the ring keeps on the epoll set and the wakeup eventfd.
+    void PollFd(int fd, uint64_t tag)
+    {
+        struct io_uring_sqe sqe;
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_POLL_ADD;
+        sqe.fd = fd;
+        sqe.poll32_events = POLLIN;
+        sqe.len = IORING_POLL_ADD_MULTI;
+        sqe.user_data = tag;
+        _staged.push_back(sqe);
+    }
+
+    int Stage(struct io_uring_sqe & sqe, Op op, void * data, std::shared_ptr<void> keep)
+    {
+        if ( _backend != Backend::IO_URING || !Valid() || sqe.fd < 0 )
+            return -1;
+        bool wake;
+        {
+            std::lock_guard<std::mutex> lk(_stageMx);
+            sqe.user_data = _nextTag++;
+            _ops.emplace(sqe.user_data, Pending{ op, data, std::move(keep) });
+            _staged.push_back(sqe);
+            wake = _waiting;
+        }
+        if ( wake )
+            Wakeup();
+        return 0;
+    }
+
+    int Stage(struct io_uring_sqe const & sqe)
+    {
+        if ( _backend != Backend::IO_URING || !Valid() )
+            return -1;
+        bool wake;
+        {
+            std::lock_guard<std::mutex> lk(_stageMx);
+            _staged.push_back(sqe);
+            wake = _waiting;
+        }
+        if ( wake )
+            Wakeup();
+        return 0;
+    }
+
+    // Moves staged requests into the submission queue. `waiting` tells
+    // Stage() callers on other threads whether they have to wake the loop.
+    // What does not fit, with the queue still full after submitting it,
+    // stays staged for the next call; returns false if anything did.
+    bool FlushStaged(bool waiting)
+    {
+        std::lock_guard<std::mutex> lk(_stageMx);
+        std::size_t moved = 0;
+        for ( ; moved < _staged.size(); ++moved ) {
+            auto sqe = _ring.GetSqe();
+            if ( sqe == nullptr )
+                break;
+            *sqe = _staged[moved];
+        }
+        _staged.erase(_staged.begin(), _staged.begin() + moved);
+        _waiting = waiting && _staged.empty();
+        return _staged.empty();
+    }
+
+    int WaitForRing(EventsVec & events, int timeout)
+    {
+        // The previous batch has been handled: its buffers go back to the
+        // kernel and finished operations drop what they kept alive.
+        for ( auto bid : _consumed )
+            _ring.ReturnBuffer(bid);
+        _ring.PublishBuffers();
+        _consumed.clear();
+        _completions.clear();
+        _finished.clear();
+
+        // A backlog is retried once this round's completions are reaped,
+        // which is what lets the kernel take more submissions.
+        bool flushed = FlushStaged(true);
+        bool ready = !flushed || _epollBacklog || _ring.HasCompletions();
+        auto ret = _ring.Enter(ready ? 0 : 1, ready ? 0 : timeout);
+        LOG_IF(ERROR, ret < 0 && errno != EINTR && errno != ETIME) << "io_uring_enter failed: " << std::strerror(errno);
+
+        bool epollReady = _epollBacklog;
+        bool woken = false;
+        Reap(epollReady, woken);
+        if ( woken ) {
+            _wakePending.store(false, std::memory_order_release);
+            uint64_t count;
+            auto got = ::read(_wakefd, &count, sizeof(count));
+            (void) got;
+        }
+        int n = 0;
+        if ( epollReady ) {
+            n = epoll_wait(_fd, events.data(), events.size(), 0);
+            // Level-triggered fds still ready after this call do not wake the
+            // ring's poll again; keep checking until the set is drained.
+            _epollBacklog = n > 0;
+        }
+        return n;
+    }
+
+    void Reap(bool & epollReady, bool & woken)
+    {
+        std::lock_guard<std::mutex> lk(_stageMx);
+        _waiting = false;
+        _ring.ForEachCompletion([&] (struct io_uring_cqe const & cqe) {
+            bool more = cqe.flags & IORING_CQE_F_MORE;
+            if ( cqe.user_data < FIRST_TAG ) {
+                if ( cqe.user_data == EPOLL_TAG )
+                    epollReady = true;
+                else if ( cqe.user_data == WAKE_TAG )
+                    woken = true;
+                if ( cqe.user_data != CANCEL_TAG && !more && Valid() && !_closing )
+                    PollFd(cqe.user_data == EPOLL_TAG ? _fd : _wakefd, cqe.user_data);
+                return;
+            }
+            char const * buffer = nullptr;
+            if ( cqe.flags & IORING_CQE_F_BUFFER ) {
+                uint16_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+                buffer = _ring.Buffer(bid);
+                _consumed.push_back(bid);
+            }
+            auto it = _ops.find(cqe.user_data);
+            if ( it == _ops.end() )
+                return;
+            _completions.push_back({ it->second.op, it->second.data, cqe.res, more, buffer });
+            if ( !more ) {
+                _finished.push_back(std::move(it->second.keep));
+                _ops.erase(it);
+            }
+        });
+    }
+
+    // Cancels what is still in flight and waits briefly for the kernel to
+    // let go of the memory those operations point at.
+    void ShutdownRing()
+    {
+        _closing = true;
+        struct io_uring_sqe sqe;
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_ASYNC_CANCEL;
+        sqe.fd = -1;
+        sqe.cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+        sqe.user_data = CANCEL_TAG;
+        {
+            std::lock_guard<std::mutex> lk(_stageMx);
+            _staged.push_back(sqe);
+        }
+        for ( int i = 0; i < 10; ++i ) {
+            FlushStaged(false);
+            bool epollReady = false, woken = false;
+            {
+                std::lock_guard<std::mutex> lk(_stageMx);
+                if ( _ops.empty() )
+                    break;
+            }
+            _ring.Enter(1, 10);
+            Reap(epollReady, woken);
+        }
+        _ring.Shutdown();
+        // Released outside the lock: the last reference may close a socket.
+        std::unordered_map<uint64_t, Pending> ops;
+        {
+            std::lock_guard<std::mutex> lk(_stageMx);
+            _staged.clear();
+            ops.swap(_ops);
+        }
+        _completions.clear();
+        _finished.clear();
+        _consumed.clear();
     }
 
 private:
     int _fd;
     uint32_t _events;
+    int _wakefd;
+    std::atomic_bool _wakePending;
+    Backend _backend;
+    IoUring _ring;
+    std::mutex _stageMx;
+    std::vector<struct io_uring_sqe> _staged;       // guarded by _stageMx
+    std::unordered_map<uint64_t, Pending> _ops;     // in flight, guarded by _stageMx
+    uint64_t _nextTag;                              // guarded by _stageMx
+    bool _waiting;                                  // loop is in Enter(), guarded by _stageMx
+    std::vector<Completion> _completions;
+    std::vector<std::shared_ptr<void>> _finished;   // kept until the batch is handled
+    std::vector<uint16_t> _consumed;                // buffers of the batch
+    bool _epollBacklog;
+    bool _closing;
 };
 
 } // namespace reactor
@@ -2,21 +2,29 @@
 #define DISPATCHER_H
 
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
 #include <cstdint>
+#include <cstring>
 #include <functional>
 #include <memory>
 #include <mutex>
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <thread>
 #include <unistd.h>
-#include <unordered_map>
+#include <utility>
 #include <vector>
 #include "AcceptHandler.h"
 #include "Demultiplexer.h"
 #include "EventsHandler.h"
+#include "FdTable.h"
 #include "Handler.h"
 #include "server/logging/LogMessage.h"
 #include "server/logging/Logging.h"
 #include "server/threadpool/ThreadPool.h"
+#include "server/threadpool/TimingWheel.h"
 
 namespace server {
 namespace reactor {
@@ -24,9 +32,39 @@ namespace reactor {
 using namespace server::threadpool;
 class Dispatcher {
 public:
-   typedef std::unordered_map<int, std::shared_ptr<Channel>> ChannelMap;
-   typedef std::unordered_map<int, std::shared_ptr<Handler>> HandlerMap;
+   typedef FdTable<Channel> ChannelTable;
+   typedef FdTable<Handler> HandlerTable;
    typedef std::vector<std::shared_ptr<Dispatcher>> DispatcherVec;
+   typedef std::function<void(std::shared_ptr<Channel>)> ConnectionCallback;
+   typedef TimingWheel::TimerId TimerId;
+
+   struct LoopStats
+   {
+       int64_t connections;   // currently owned by the loop
+       uint64_t accepted;     // taken from the loop's own listening socket
+       uint64_t events;       // epoll events and io_uring completions handled so far
+       uint64_t recentRate;   // events per second over the last RATE_WINDOW
+       std::chrono::steady_clock::time_point at;
+   };
+
+   // How HandleNewConnection picks the slave that owns a new connection.
+   enum class Placement
+   {
+       ROUND_ROBIN,
+       LEAST_CONNECTIONS,
+       LEAST_EVENT_RATE,
+       PEER_HASH, // same client address, same loop; few move when slaves are added
+   };
+
+   // Custom placement: gets the new fd and every slave's stats, returns the
+   // index of the slave to own it.
+   typedef std::function<std::size_t(int fd, std::vector<LoopStats> const & slaves)> PlacementPolicy;
+
+   constexpr static std::chrono::milliseconds RATE_WINDOW{250};
+   // Pause before accepting again when out of descriptors with nothing to shed.
+   constexpr static std::chrono::milliseconds ACCEPT_BACKOFF{100};
+   // How soon an idle loop looks again at a migrating connection still in use by the pool.
+   constexpr static std::chrono::milliseconds MIGRATE_RETRY{1};
 public:
     Dispatcher()
         : _stop(false)
@@ -38,7 +76,40 @@ public:
           , _handlers()
           , _pool(ThreadPool::GetGlobalThreadPool())
           , _pendingFn()
-    {}
+          , _runningFn()
+          , _hasPending(false)
+          , _lifeMx()
+          , _running(false)
+          , _loopThread()
+          , _batch()
+          , _loopCpus()
+          , _pinSlaves(false)
+          , _onConnection()
+          , _timerfd(::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC))
+          , _timers()
+          , _timerMx()
+          , _armedAt(0)
+          , _acceptor(nullptr)
+          , _retired()
+          , _retireMx()
+          , _epoch(0)
+          , _inlineIo(false)
+          , _master(nullptr)
+          , _slaveThreads()
+          , _nextSlave(0)
+          , _connections(0)
+          , _accepted(0)
+          , _eventCount(0)
+          , _recentRate(0)
+          , _sampledEvents(0)
+          , _placement(Placement::ROUND_ROBIN)
+          , _placementPolicy()
+    {
+        _batch.reserve(_events.size());
+        LOG_IF(ERROR, _timerfd < 0) << "Failed to create timerfd";
+        if ( _timerfd >= 0 )
+            _demultiplexer.RegisterFd(_timerfd, EPOLLIN, this);
+    }
 
     Dispatcher(Dispatcher &&) = delete;
     Dispatcher(const Dispatcher &) = delete;
@@ -46,62 +117,136 @@ public:
     Dispatcher &operator=(const Dispatcher &) = delete;
     ~Dispatcher() { Shutdown(); }
 
+    // Runs the loop until Shutdown(); the loop then releases its resources
+    // itself, on this thread, so Shutdown() never closes fds under it.
     void Dispatch()
     {
+        {
+            std::lock_guard<std::mutex> lk(_lifeMx);
+            if ( _stop )
+                return;
+            _running = true;
+        }
+        _loopThread = std::this_thread::get_id();
+        if ( !_loopCpus.empty() )
+            PinCurrentThread(_loopCpus);
         while ( !_stop ) {
+            Reclaim();
             int numEvents = _demultiplexer.WaitForEvents(_events);
-            if ( numEvents <= 0 )
-                continue;
-            auto it = _events.begin();
-            std::for_each(it, it + numEvents, [this] (struct epoll_event & event) {
-                auto fd = event.data.fd;
-                auto it = _handlers.find(fd);
-                int accepted = 0;
-                if ( it == _handlers.end() )
-                    return;
-                if ( fd == _masterfd ) {
-                    auto acceptor = dynamic_cast<AcceptHandler *>(it->second.get());
-                    acceptor->HandleEvent(event.events);
-                    HandleNewConnection(acceptor->getAccepted());
-                } else {
-                    auto handler = it->second;
-                    auto events = event.events;
-                    _pool.EnqueueTask([handler, events] { handler->HandleEvent(events); });
-                }
-
-                HandleUnexpected(fd, event.events);
-
-                std::vector<std::function<void()>> pendingFn;
-                {
-                    std::lock_guard<std::mutex> lk(_pendingMx);
-                    pendingFn = std::move(_pendingFn);
-                }
-                for ( auto & fn : pendingFn )
-                    fn();
-            });
+            if ( numEvents > 0 )
+                HandleEvents(numEvents);
+            if ( !_demultiplexer.GetCompletions().empty() )
+                HandleCompletions(_demultiplexer.GetCompletions());
+            SubmitBatch();
+            RunPending();
+        }
+        _loopThread = std::thread::id();
+        {
+            std::lock_guard<std::mutex> lk(_lifeMx);
+            _running = false;
         }
+        Close();
     }
 
+    // Runs `fn` on this loop: right away when called from it, otherwise
+    // after the current batch of events.
+    template<typename Fn>
+    void RunInLoop(Fn && fn)
+    {
+        if ( _loopThread == std::this_thread::get_id() )
+            fn();
+        else
+            QueueInLoop(std::forward<Fn>(fn));
+    }
+
+    // Queues `fn` for this loop and wakes it if it is waiting for events.
+    // The loop takes the whole queue with one swap per iteration.
+    template<typename Fn>
+    void QueueInLoop(Fn && fn)
+    {
+        {
+            std::lock_guard<std::mutex> lk(_pendingMx);
+            _pendingFn.emplace_back(std::forward<Fn>(fn));
+        }
+        _hasPending.store(true, std::memory_order_release);
+        _demultiplexer.Wakeup();
+    }
+
+    // Queues `data` for connection `fd` on the loop that polls it, which
+    // writes it straight to the socket; the caller makes no syscall beyond
+    // a possible wakeup. Returns false if `fd` is not a live connection.
+    // `data` is a std::string, moved along, or a SharedBuffer, which is
+    // shared rather than copied, e.g. to send one payload to many fds.
+    // The channel is looked up on that loop, lock-free, by fd and
+    // generation, so a connection closed meanwhile is skipped.
+    template<typename Data>
+    bool Send(int fd, Data data)
+    {
+        return Send(fd, _allChannel.Generation(fd), std::move(data));
+    }
+
+    // Same, addressed to the connection inserted at `generation` (see
+    // Channel::Generation()): a reply computed for a connection that has
+    // since closed is dropped rather than sent to whoever reuses the fd.
+    template<typename Data>
+    bool Send(int fd, uint32_t generation, Data data)
+    {
+        if ( _allChannel.Find(fd, generation) == nullptr )
+            return false;
+        auto owner = OwnerOf(fd);
+        if ( owner == nullptr ) {
+            if ( auto channel = _allChannel.Get(fd, generation) )
+                channel->NotifyWriteEvent(data);
+            return true;
+        }
+        owner->RunInLoop([fd, generation, data = std::move(data)] () {
+            if ( auto channel = _allChannel.Find(fd, generation) )
+                channel->Send(data);
+        });
+        return true;
+    }
+
+
     bool RegisterHandler(int fd, std::shared_ptr<Handler> handler)
     {
         if ( _stop || fd < 0 )
             return false;
-        _demultiplexer.RegisterFd(fd);
-        std::lock_guard<std::mutex> lk(_globalMx);
-        return _handlers.try_emplace(fd, handler).second;
+        auto data = handler.get();
+        handler->SetHandle(fd);
+        if ( !_handlers.Insert(fd, handler) )
+            return false;
+        auto completions = _demultiplexer.GetBackend() == Demultiplexer::Backend::IO_URING;
+        if ( completions && data == _acceptor )
+            _demultiplexer.Accept(fd, data, std::move(handler));
+        else if ( completions && handler->GetChannel() )
+            _demultiplexer.Receive(fd, data, std::move(handler));
+        else if ( data == _acceptor )
+            return RegisterListener(fd, data);
+        else if ( _demultiplexer.RegisterFd(fd, _demultiplexer.GetEvents(), data) < 0 ) {
+            _handlers.Take(fd);
+            return false;
+        }
+        return true;
     }
 
     int RemoveHandler(int fd)
     {
         if ( _stop || fd < 0 )
             return -1;
-        std::lock_guard<std::mutex> lk(_globalMx);
-        auto it = _allChannel.find(fd);
-        if ( it != _allChannel.end() && it->first == fd ) {
-            _allChannel.erase(fd);
-            it->second->Inactive();
+        auto channel = _allChannel.Take(fd);
+        auto handler = _handlers.Take(fd);
+        int removed = handler != nullptr;
+        if ( handler ) {
+            if ( handler->GetChannel() ) {
+                _connections.fetch_sub(1, std::memory_order_relaxed);
+                CancelTimer(handler->GetChannel()->TakeTimeoutTimer());
+            }
+            Unwatch(fd, handler.get());
+            Retire(std::move(handler));
         }
-        return _handlers.erase(fd);
+        if ( channel )
+            channel->Inactive();
+        return removed;
     }
 
     void EnableSlave(bool b)
@@ -111,18 +256,151 @@ public:
         _enableSlave = b;
     }
 
+    // Each slave runs its own loop on a dedicated thread; connections this
+    // loop accepts are handed to them round robin.
     void AddSlaveDispatcher(int n = 1)
     {
         if ( _stop || !_enableSlave )
             return;
         for ( int i = 0; i < n; ++i )
-        {
-            _slaves.emplace_back(std::make_shared<Dispatcher>());
-            auto & slave = _slaves.back();
-            _pool.EnqueueTask(&Dispatcher::Dispatch, slave.get());;
+            RunSlave(NewSlave());
+    }
+
+    // Adds a slave that accepts on its own listening socket `fd`, usually
+    // one of several SO_REUSEPORT sockets bound to the same address (see
+    // TcpServer::ReusePort). The kernel spreads connections across them,
+    // and each slave serves the ones it accepted from start to end.
+    // Slaves may also share one socket, each given its own dup() of it:
+    // listeners are registered with EPOLLEXCLUSIVE, so a connection wakes
+    // only one of them.
+    void AddSlaveListener(int fd)
+    {
+        if ( _stop || !_enableSlave || fd < 0 )
+            return;
+        auto slave = NewSlave();
+        slave->SetMasterFD(fd);
+        RunSlave(std::move(slave));
+    }
+
+    LoopStats Stats() const
+    {
+        return { _connections.load(std::memory_order_relaxed),
+                 _accepted.load(std::memory_order_relaxed),
+                 _eventCount.load(std::memory_order_relaxed),
+                 _recentRate.load(std::memory_order_relaxed),
+                 std::chrono::steady_clock::now() };
+    }
+
+    // Set before connections arrive; applies to connections this loop
+    // accepts and hands to its slaves.
+    void SetPlacement(Placement placement)
+    {
+        _placement = placement;
+        _placementPolicy = nullptr;
+    }
+
+    void SetPlacement(PlacementPolicy policy) { _placementPolicy = std::move(policy); }
+
+    // Moves connection `fd` to slave `index`, e.g. to take a hot, long-lived
+    // connection off a busy loop. The owning loop stops polling the fd
+    // after its current batch, waits for the pool tasks still handling it
+    // and then hands it to the new loop, which registers it on its own
+    // thread, so no event is handled on both. Returns false if `fd` is not a
+    // connection of one of the slaves or `index` is out of range, and with
+    // the io_uring backend, whose receives stay with the ring they were
+    // submitted to.
+    bool MigrateConnection(int fd, std::size_t index)
+    {
+        if ( _stop || index >= _slaves.size() || _demultiplexer.GetBackend() == Demultiplexer::Backend::IO_URING )
+            return false;
+        auto target = _slaves[index].get();
+        for ( auto & slave : _slaves ) {
+            auto handler = slave->_handlers.Get(fd);
+            if ( handler == nullptr || handler->GetChannel() == nullptr )
+                continue;
+            if ( slave.get() != target )
+                slave->QueueInLoop([owner = slave.get(), fd, target] { owner->Detach(fd, target); });
+            return true;
         }
+        return false;
+    }
+
+    // Same, to the slave with the lowest recent event rate.
+    bool MigrateConnection(int fd)
+    {
+        if ( _slaves.empty() )
+            return false;
+        return MigrateConnection(fd, LeastLoaded(&Dispatcher::RateLoad));
+    }
+
+    std::vector<LoopStats> SlaveStats() const
+    {
+        std::vector<LoopStats> stats;
+        stats.reserve(_slaves.size());
+        for ( auto & slave : _slaves )
+            stats.push_back(slave->Stats());
+        return stats;
+    }
+
+    // Events per second between two samples of the same loop.
+    static double EventRate(LoopStats const & earlier, LoopStats const & later)
+    {
+        std::chrono::duration<double> elapsed = later.at - earlier.at;
+        return elapsed.count() > 0 ? ( later.events - earlier.events ) / elapsed.count() : 0.0;
+    }
+
+    // Runs socket reads and writes on the loop that owns the connection
+    // instead of handing every event to the pool: no cross-thread hop, and
+    // a connection's events are handled one at a time, in order. Only the
+    // work the application posts itself (HandleReadyData, coroutines that
+    // co_await Schedule()) reaches the pool. Set before Dispatch() starts;
+    // applies to this loop and its slaves.
+    void SetInlineIo(bool b)
+    {
+        _inlineIo = b;
+        for ( auto & slave : _slaves )
+            slave->SetInlineIo(b);
     }
 
+    bool InlineIo() const { return _inlineIo; }
+
+    // CPUs the loop thread is restricted to once Dispatch() starts.
+    void SetLoopAffinity(std::vector<int> cpus) { _loopCpus = std::move(cpus); }
+
+    // Timers owned by this loop: callbacks run on the loop thread between
+    // event batches, so they must not block. Safe to call from any thread.
+    template<typename Rep, typename Period>
+    TimerId RunAfter(std::chrono::duration<Rep, Period> delay, std::function<void()> fn)
+    {
+        return ArmFor(_timers.RunAfter(delay, std::move(fn)));
+    }
+
+    template<typename Rep, typename Period>
+    TimerId RunEvery(std::chrono::duration<Rep, Period> interval, std::function<void()> fn)
+    {
+        return ArmFor(_timers.RunEvery(interval, std::move(fn)));
+    }
+
+    TimerId RunAt(TimingWheel::Clock::time_point deadline, std::function<void()> fn)
+    {
+        return ArmFor(_timers.RunAt(deadline, std::move(fn)));
+    }
+
+    bool CancelTimer(TimerId id) { return _timers.Cancel(id); }
+
+    // Called on the accepting loop for every new connection once it is
+    // registered, e.g. to start a per-connection coroutine.
+    void SetConnectionCallback(ConnectionCallback cb)
+    {
+        for ( auto & slave : _slaves )
+            slave->SetConnectionCallback(cb);
+        _onConnection = std::move(cb);
+    }
+
+    // Slaves added afterwards run on the NUMA node of the pool worker with
+    // the same index, so a loop and the workers serving it share a socket.
+    void PinSlavesToWorkers(bool b) { _pinSlaves = b; }
+
     Demultiplexer * const GetDemultiplexer()
     {
         if ( _stop )
@@ -132,25 +410,21 @@ public:
 
     bool Stop() const { return _stop; }
 
+    // Stops the loop. A running loop is woken and releases its resources
+    // on its own thread, slave loops included; join it afterwards.
     void Shutdown()
     {
-        if ( _stop )
+        if ( _stop.exchange(true) )
             return;
-        _stop = true;
-        std::for_each(_handlers.begin(), _handlers.end(), [&] (auto & pair) { ::close(pair.first); });
-        _handlers.clear();
-        if ( _enableSlave )
+        bool running;
         {
-            std::for_each(_slaves.begin(), _slaves.end(), [&] (auto & d) { d->Shutdown(); });
-            _slaves.clear();
+            std::lock_guard<std::mutex> lk(_lifeMx);
+            running = _running;
         }
-        if ( _masterfd != 0 )
-        {
-            _pool.Shutdown();
-            std::for_each(_allChannel.begin(), _allChannel.end(), [this] (auto & pair) { pair.second->Inactive(); });
-            _allChannel.clear();
-        }
-        _demultiplexer.Shutdown();
+        if ( running )
+            _demultiplexer.Wakeup();
+        else
+            Close();
     }
 
     void SetMasterFD(int fd)
@@ -158,115 +432,614 @@ public:
         if ( fd < 0 ) return;
         _masterfd = fd;
         LOG(INFO) << "Setup master fd " << fd;
-        RegisterHandler(fd, std::make_shared<AcceptHandler>(fd));
+        auto acceptor = std::make_shared<AcceptHandler>(fd);
+        _acceptor = acceptor.get();
+        RegisterHandler(fd, std::move(acceptor));
     }
 
-    std::shared_ptr<Channel> GetChannel(int fd)
+    std::shared_ptr<Channel> GetChannel(int fd) { return _allChannel.Get(fd); }
+
+    // Null if `fd` has been closed and reused since ChannelGeneration(fd)
+    // returned `generation`.
+    std::shared_ptr<Channel> GetChannel(int fd, uint32_t generation) { return _allChannel.Get(fd, generation); }
+
+    uint32_t ChannelGeneration(int fd) const { return _allChannel.Generation(fd); }
+
+    ChannelTable & GetAllChannel() { return _allChannel; }
+
+    server::threadpool::ThreadPool & GetThreadPool() { return _pool; }
+
+    // Runs `fn` on this loop, or on one of its slaves when it has any.
+    void AddPendingFunctor(std::function<void()> fn)
     {
-        std::lock_guard<std::mutex> lk(_globalMx);
-        auto it = _allChannel.find(fd);
-        return it == _allChannel.end() ? nullptr : it->second;
+        if ( !_enableSlave || _slaves.empty() )
+            QueueInLoop(std::move(fn));
+        else
+            _slaves.at(DispatchToSlave())->QueueInLoop(std::move(fn));
     }
 
-    ChannelMap & GetAllChannel() { return _allChannel; }
+private:
+    // Runs once, on the loop thread after its last iteration or in
+    // Shutdown() if the loop never ran, so nothing else walks _slaves.
+    void Close()
+    {
+        for ( auto & slave : _slaves )
+            slave->Shutdown();
+        for ( auto & thread : _slaveThreads )
+            thread.join();
+        _slaveThreads.clear();
+        _handlers.ForEach([this] (int fd, auto & handler) {
+            if ( handler->GetChannel() == nullptr )
+                ::close(fd);
+            Retire(handler);
+        });
+        _handlers.Clear();
+        if ( _master == nullptr && ( _masterfd != 0 || _enableSlave ) )
+        {
+            _pool.Shutdown();
+            _allChannel.ForEach([] (int, auto & channel) {
+                channel->DisableReceive();
+                channel->DisableSend();
+                channel->Inactive();
+            });
+            _allChannel.Clear();
+        }
+        _slaves.clear();
+        {
+            std::lock_guard<std::mutex> lk(_timerMx);
+            if ( _timerfd >= 0 )
+                ::close(_timerfd);
+            _timerfd = -1;
+        }
+        _demultiplexer.Shutdown();
+    }
 
-    ChannelMap ExtractExistedChannel()
+    // The loop that polls `fd`: this one or a slave.
+    Dispatcher * OwnerOf(int fd)
     {
-        std::lock_guard<std::mutex> lk(_globalMx);
-        auto tmp = std::unordered_map<int, std::shared_ptr<Channel>>();
-        _allChannel.swap(tmp);
-        return tmp;
+        if ( _handlers.Find(fd) )
+            return this;
+        for ( auto & slave : _slaves )
+            if ( slave->_handlers.Find(fd) )
+                return slave.get();
+        return nullptr;
     }
 
-    void RestoreAllChannel(ChannelMap & channels)
+    std::shared_ptr<Dispatcher> NewSlave()
     {
-        std::lock_guard<std::mutex> lk(_globalMx);
-        for( auto & fd : _waitToRemovedChannel) {
-            channels.erase(fd);
+        auto slave = std::make_shared<Dispatcher>();
+        slave->_master = this;
+        slave->SetInlineIo(_inlineIo);
+        slave->SetConnectionCallback(_onConnection);
+        slave->RunEvery(RATE_WINDOW, [loop = slave.get()] { loop->SampleRate(); });
+        if ( _pinSlaves )
+        {
+            auto & topology = CpuTopology::Get();
+            auto cpu = _pool.WorkerCpu(_slaves.size());
+            slave->SetLoopAffinity(topology.NodeCpus(topology.NodeOf(cpu)));
         }
-        _waitToRemovedChannel.clear();
-        _allChannel.insert( std::make_move_iterator(channels.begin()), std::make_move_iterator(channels.end()) );
+        return slave;
     }
 
-    server::threadpool::ThreadPool & GetThreadPool() { return _pool; }
+    void RunSlave(std::shared_ptr<Dispatcher> slave)
+    {
+        _slaveThreads.emplace_back(&Dispatcher::Dispatch, slave.get());
+        _slaves.emplace_back(std::move(slave));
+    }
 
-    void AddPendingFunctor(std::function<void()> fn)
+    void HandleEvents(int numEvents)
+    {
+        _eventCount.fetch_add(numEvents, std::memory_order_relaxed);
+        auto it = _events.begin();
+        std::for_each(it, it + numEvents, [this] (struct epoll_event & event) {
+            // data.ptr is the registered Handler, or this loop for its timerfd.
+            if ( event.data.ptr == this ) {
+                HandleTimers();
+                return;
+            }
+            auto handler = static_cast<Handler *>(event.data.ptr);
+            if ( handler == _acceptor ) {
+                DrainAcceptor(event.events);
+            } else if ( _inlineIo ) {
+                handler->HandleEvent(event.events);
+            } else {
+                auto events = event.events;
+                _batch.emplace_back([handler = handler->shared_from_this(), events] { handler->HandleEvent(events); });
+            }
+
+            HandleUnexpected(handler->GetHandle(), event.events, handler);
+        });
+    }
+
+    void DrainAcceptor(uint32_t events)
+    {
+        _acceptor->HandleEvent(events);
+        auto & accepted = _acceptor->GetAccepted();
+        _accepted.fetch_add(accepted.size(), std::memory_order_relaxed);
+        for ( auto & peer : accepted )
+            HandleNewConnection(peer.fd, &peer.addr);
+        // The edge is spent but the backlog is not: nothing would report
+        // it again before the next client connects.
+        if ( _acceptor->Stalled() && !_stop )
+            RunAfter(ACCEPT_BACKOFF, [this] {
+                if ( _acceptor && _handlers.Find(_masterfd) == _acceptor )
+                    DrainAcceptor(EPOLLIN);
+            });
+    }
+
+    // Results from a completion backend. Received bytes are copied into
+    // the channel here, before the buffer goes back to the kernel; what
+    // reacts to them goes to the pool, as a readiness event would, unless
+    // I/O runs inline.
+    void HandleCompletions(std::vector<Demultiplexer::Completion> const & completions)
+    {
+        _eventCount.fetch_add(completions.size(), std::memory_order_relaxed);
+        for ( auto & completion : completions ) {
+            switch ( completion.op ) {
+            case Demultiplexer::Op::ACCEPT:
+                HandleAccepted(completion);
+                break;
+            case Demultiplexer::Op::RECEIVE:
+                HandleReceived(completion);
+                break;
+            case Demultiplexer::Op::SEND: {
+                auto channel = static_cast<Channel *>(completion.data);
+                auto res = completion.res;
+                if ( _inlineIo )
+                    channel->SendDone(res);
+                else
+                    _batch.emplace_back([channel = channel->shared_from_this(), res] { channel->SendDone(res); });
+                break;
+            }
+            }
+        }
+    }
+
+    void HandleAccepted(Demultiplexer::Completion const & completion)
+    {
+        if ( completion.res >= 0 ) {
+            _accepted.fetch_add(1, std::memory_order_relaxed);
+            LOG(INFO) << "Accecpting new connection: { FD = " << completion.res << " }.";
+            HandleNewConnection(completion.res);
+        } else {
+            LOG(ERROR) << "Failed to accept new connection: " << std::strerror(-completion.res);
+        }
+        if ( completion.more || _stop || completion.data != _acceptor )
+            return;
+        // Out of descriptors, re-arming alone would fail on the same
+        // connection right away: drop it, or back off if that is impossible.
+        if ( ( completion.res == -EMFILE || completion.res == -ENFILE ) && !_acceptor->Shed() ) {
+            RunAfter(ACCEPT_BACKOFF, [this] { RearmAccept(); });
+            return;
+        }
+        RearmAccept();
+    }
+
+    void RearmAccept()
+    {
+        if ( _acceptor && _handlers.Find(_masterfd) == _acceptor )
+            _demultiplexer.Accept(_masterfd, _acceptor, _acceptor->shared_from_this());
+    }
+
+    void HandleReceived(Demultiplexer::Completion const & completion)
+    {
+        auto handler = static_cast<Handler *>(completion.data);
+        auto channel = handler->GetChannel();
+        auto fd = handler->GetHandle();
+        if ( completion.res > 0 && channel->Active() ) {
+            channel->Received(completion.buffer, completion.res);
+            if ( _inlineIo )
+                channel->NotifyReceived();
+            else
+                _batch.emplace_back([channel] { channel->NotifyReceived(); });
+        }
+        if ( completion.res == 0 || ( completion.res < 0 && completion.res != -ENOBUFS ) ) {
+            if ( completion.res < 0 && completion.res != -ECANCELED )
+                LOG(ERROR) << "Failed to receive { FD = " << fd << ", ERROR = " << std::strerror(-completion.res) << " }";
+            if ( _handlers.Find(fd) != handler )
+                return;
+            if ( _inlineIo )
+                channel->PeerClosed();
+            else
+                _batch.emplace_back([channel] { channel->PeerClosed(); });
+            HandleUnexpected(fd, EPOLLHUP, handler);
+            return;
+        }
+        // Out of buffers, or the kernel ended it: arm it again. The
+        // previous batch's buffers return before the next wait.
+        if ( !completion.more && channel->Active() && _handlers.Find(fd) == handler )
+            _demultiplexer.Receive(fd, handler, handler->shared_from_this());
+    }
+
+    void RunPending()
     {
-        if ( !_enableSlave )
+        if ( !_hasPending.exchange(false, std::memory_order_acq_rel) )
+            return;
         {
             std::lock_guard<std::mutex> lk(_pendingMx);
-            _pendingFn.emplace_back(std::move(fn));
+            _runningFn.swap(_pendingFn);
         }
-        else {
-            auto & slave = _slaves.at(DispatchToSlave());
-            slave->AddPendingFunctor(std::move(fn));
+        for ( auto & fn : _runningFn )
+            fn();
+        _runningFn.clear();
+    }
+
+    void HandleTimers()
+    {
+        uint64_t expirations;
+        while ( ::read(_timerfd, &expirations, sizeof(expirations)) > 0 ) ;
+        _timers.Advance();
+        std::lock_guard<std::mutex> lk(_timerMx);
+        Arm();
+    }
+
+    // Re-arms the timerfd only when the new timer is due before the one it
+    // is already set for; the loop re-arms for everything else after firing.
+    TimerId ArmFor(TimerId id)
+    {
+        std::lock_guard<std::mutex> lk(_timerMx);
+        auto next = _timers.NextExpiry().time_since_epoch().count();
+        if ( _armedAt == 0 || next < _armedAt )
+            Arm();
+        return id;
+    }
+
+    void Arm()
+    {
+        if ( _timerfd < 0 )
+            return;
+        auto next = _timers.NextExpiry();
+        struct itimerspec spec = {};
+        if ( next == TimingWheel::Clock::time_point::max() ) {
+            _armedAt = 0;
+        } else {
+            // timerfd reads CLOCK_MONOTONIC, the clock behind steady_clock on Linux.
+            auto ns = std::max<int64_t>(1, std::chrono::duration_cast<std::chrono::nanoseconds>(next.time_since_epoch()).count());
+            spec.it_value.tv_sec = ns / 1000000000;
+            spec.it_value.tv_nsec = ns % 1000000000;
+            _armedAt = next.time_since_epoch().count();
         }
+        ::timerfd_settime(_timerfd, TFD_TIMER_ABSTIME, &spec, nullptr);
     }
 
-private:
-    void HandleUnexpected(int fd, uint32_t events)
+    // Handlers are freed lazily: an event collected before the fd left the
+    // epoll set may still point at one. A handler retired while batch N was
+    // current is freed once batch N has been processed, since every later
+    // epoll_wait started after its EPOLL_CTL_DEL.
+    void Retire(std::shared_ptr<Handler> handler)
     {
-        if ( events & EPOLLERR || events & EPOLLHUP || events & EPOLLRDHUP ) {
-            _handlers.erase(fd);
+        if ( handler == nullptr )
+            return;
+        std::lock_guard<std::mutex> lk(_retireMx);
+        _retired.push_back({ _epoch, std::move(handler), nullptr });
+    }
+
+    // EPOLLEXCLUSIVE admits only EPOLLIN, EPOLLOUT, EPOLLWAKEUP and EPOLLET
+    // besides it, anything else fails the add with EINVAL.
+    bool RegisterListener(int fd, Handler * data)
+    {
+        uint32_t allowed = EPOLLIN | EPOLLOUT | EPOLLWAKEUP | EPOLLET;
+        auto events = ( _demultiplexer.GetEvents() & allowed ) | static_cast<uint32_t>(EPOLLEXCLUSIVE);
+        if ( _demultiplexer.RegisterFd(fd, events, data) < 0 ) {
+            LOG(ERROR) << "Failed to poll listener { FD = " << fd << ", ERROR = " << std::strerror(errno) << " }";
+            _handlers.Take(fd);
+            return false;
+        }
+        return true;
+    }
+
+    // On a completion backend only fds registered as readiness sources are
+    // in the epoll set; cancelling the others ends their pending accept or
+    // receive, whose final completion then lets go of the handler.
+    void Unwatch(int fd, Handler * handler)
+    {
+        if ( _demultiplexer.GetBackend() == Demultiplexer::Backend::IO_URING
+             && handler && ( handler == _acceptor || handler->GetChannel() ) )
+            _demultiplexer.Cancel(fd);
+        else
             _demultiplexer.RemoveFd(fd);
-            ::close(fd);
+    }
+
+    // A migrating handler also waits until no pool task of an earlier
+    // batch holds it any more; the target loop then adopts it.
+    void Reclaim()
+    {
+        std::vector<Retired> dead;
+        bool held = false;
+        {
+            std::lock_guard<std::mutex> lk(_retireMx);
+            if ( !_retired.empty() ) {
+                auto alive = std::partition(_retired.begin(), _retired.end(), [this] (auto & entry) {
+                    return entry.epoch > _epoch || ( entry.target && entry.handler.use_count() > 1 );
+                });
+                held = std::any_of(_retired.begin(), alive, [this] (auto & entry) { return entry.target && entry.epoch <= _epoch; });
+                dead.assign(std::make_move_iterator(alive), std::make_move_iterator(_retired.end()));
+                _retired.erase(alive, _retired.end());
+            }
+            ++_epoch;
+        }
+        if ( held )
+            RunAfter(MIGRATE_RETRY, [] {});
+        // Pairs with the release in the last task's reference drop.
+        std::atomic_thread_fence(std::memory_order_acquire);
+        for ( auto & entry : dead )
+            if ( entry.target )
+                entry.target->RunInLoop([target = entry.target, handler = std::move(entry.handler)] () mutable {
+                    target->Adopt(std::move(handler));
+                });
+    }
+
+    void SubmitBatch()
+    {
+        if ( _batch.empty() )
+            return;
+        _pool.EnqueueBatch(_batch, Priority::HIGH);
+        // A full bounded pool refuses tasks; handle them here rather than lose the edge.
+        for ( auto & task : _batch )
+            if ( task )
+                task();
+        _batch.clear();
+    }
+
+    // With `expected` set, does nothing unless that handler still owns `fd`:
+    // a retired handler's fd may already belong to a new connection.
+    void HandleUnexpected(int fd, uint32_t events, Handler * expected = nullptr)
+    {
+        if ( events & EPOLLERR || events & EPOLLHUP || events & EPOLLRDHUP ) {
+            if ( expected && _handlers.Find(fd) != expected )
+                return;
+            // Unpublish before closing: once the fd is closed the kernel may
+            // hand the same number to the next accept.
+            auto channel = _allChannel.Take(fd);
+            auto handler = _handlers.Take(fd);
+            if ( handler && handler->GetChannel() ) {
+                _connections.fetch_sub(1, std::memory_order_relaxed);
+                CancelTimer(handler->GetChannel()->TakeTimeoutTimer());
+            }
+            Unwatch(fd, handler.get());
+            // A connection's fd is closed by its Channel once the workers
+            // still using it are done; only shut the socket down here.
+            if ( handler && handler->GetChannel() == nullptr )
+                ::close(fd);
+            Retire(std::move(handler));
 
-            char ip_str[INET_ADDRSTRLEN];
-            uint16_t port = 0;
-            AcceptHandler::GetPeerHostInfo(ip_str, INET_ADDRSTRLEN, fd, port);
             LOG(INFO) << "Close accepted connection: { FD = " << fd << " }";
 
-            std::lock_guard<std::mutex> lk(_globalMx);
-            auto it = _allChannel.find(fd);
-            if ( it != _allChannel.end() && it->first == fd ) {
-                it->second->Inactive();
-                _allChannel.erase(fd);
-            } else {
-                _waitToRemovedChannel.emplace_back(fd);
+            if ( channel ) {
+                channel->DisableReceive();
+                channel->DisableSend();
+                channel->Inactive();
             }
         }
     }
 
-    void HandleNewConnection(int fd)
+    // `peer` is the address accept returned, if the caller kept it.
+    void HandleNewConnection(int fd, struct sockaddr_storage const * peer = nullptr)
     {
+        if ( fd < 0 )
+            return;
+        if ( _pool.Saturated(Priority::HIGH) ) {
+            LOG(WARN) << "Thread pool queue is full (depth " << _pool.QueueDepth() << "), shedding new connection { FD = " << fd << " }";
+            ::close(fd);
+            return;
+        }
+        auto owner = ( !_enableSlave || !_slaves.size() ) ? this : _slaves.at(PickSlave(fd, peer)).get();
         std::shared_ptr<Handler> handler = std::make_shared<EventsHandler>();
-        auto channel = std::make_shared<Channel>(fd, &_demultiplexer);
+        // The channel re-arms EPOLLOUT on the loop that polls its fd.
+        auto channel = std::make_shared<Channel>(fd);
+        channel->SetPeer(peer);
+        channel->SetDemultiplexer(&owner->_demultiplexer, handler.get());
         handler->SetChannel(channel);
-        {
-            std::lock_guard<std::mutex> lk(_globalMx);
-            _allChannel.emplace(fd, channel);
+        // From here the channel owns `fd` and closes it when dropped.
+        if ( !_allChannel.Insert(fd, channel) ) {
+            LOG(ERROR) << "Cannot track connection { FD = " << fd << " }";
+            return;
         }
-        if ( !_enableSlave || !_slaves.size() )
-            RegisterHandler(fd, handler);
-        else
-        {
-            auto & slave = _slaves.at(DispatchToSlave());
-            slave->RegisterHandler(fd, handler);
+        channel->SetGeneration(_allChannel.Generation(fd));
+        if ( !owner->RegisterHandler(fd, handler) ) {
+            LOG(ERROR) << "Cannot poll connection { FD = " << fd << " }";
+            _allChannel.Erase(fd);
+            return;
         }
+        owner->_connections.fetch_add(1, std::memory_order_relaxed);
+        if ( _onConnection )
+            _onConnection(channel);
+        owner->WatchTimeouts(channel);
+    }
+
+    // One wheel timer per connection, armed for the channel's earliest
+    // deadline. I/O only stamps the channel; when the timer fires early it
+    // moves itself to the new deadline, otherwise the connection is closed
+    // the same way a hang-up would close it. The channel keeps the timer's
+    // id, so a connection that goes away first cancels it.
+    void WatchTimeouts(std::shared_ptr<Channel> const & channel)
+    {
+        auto deadline = channel->Deadline();
+        if ( deadline == 0 )
+            return;
+        auto at = TimingWheel::Clock::time_point(std::chrono::duration_cast<TimingWheel::Clock::duration>(std::chrono::nanoseconds(deadline)));
+        channel->SetTimeoutTimer(RunAt(at, [this, weak = std::weak_ptr<Channel>(channel)] {
+            auto channel = weak.lock();
+            if ( !channel || !channel->Active() )
+                return;
+            // Migrated away; the new owner watches it now.
+            auto handler = _handlers.Find(channel->GetHandle());
+            if ( !handler || handler->GetChannel() != channel )
+                return;
+            auto deadline = std::chrono::nanoseconds(channel->Deadline());
+            if ( deadline.count() == 0 )
+                return;
+            if ( deadline > TimingWheel::Clock::now().time_since_epoch() ) {
+                WatchTimeouts(channel);
+                return;
+            }
+            LOG(INFO) << "Connection timed out { FD = " << channel->GetHandle() << " }";
+            HandleUnexpected(channel->GetHandle(), EPOLLHUP, handler);
+        }));
     }
 
     int DispatchToSlave()
     {
-        std::lock_guard<std::mutex> lk(_globalMx);
-        auto count = _slaves.size();
-        int cur = 0;
-        return ( cur++ ) % count;
+        return _nextSlave.fetch_add(1, std::memory_order_relaxed) % _slaves.size();
+    }
+
+    std::size_t PickSlave(int fd, struct sockaddr_storage const * peer)
+    {
+        if ( _placementPolicy )
+            return _placementPolicy(fd, SlaveStats()) % _slaves.size();
+        switch ( _placement ) {
+        case Placement::LEAST_CONNECTIONS:
+            return LeastLoaded([] (Dispatcher & d) { return d._connections.load(std::memory_order_relaxed); });
+        case Placement::LEAST_EVENT_RATE:
+            return LeastLoaded(&Dispatcher::RateLoad);
+        case Placement::PEER_HASH:
+            return JumpHash(PeerHash(fd, peer), _slaves.size());
+        default:
+            return DispatchToSlave();
+        }
+    }
+
+    // Idle loops all report a rate of 0; break ties by connection count.
+    static std::pair<uint64_t, int64_t> RateLoad(Dispatcher & d)
+    {
+        return { d._recentRate.load(std::memory_order_relaxed), d._connections.load(std::memory_order_relaxed) };
+    }
+
+    template<typename Load>
+    std::size_t LeastLoaded(Load && load)
+    {
+        std::size_t best = 0;
+        for ( std::size_t i = 1; i < _slaves.size(); ++i )
+            if ( load(*_slaves[i]) < load(*_slaves[best]) )
+                best = i;
+        return best;
+    }
+
+    // Hashes the peer's address without the port, so every connection from
+    // one client host lands on the same loop.
+    static uint64_t PeerHash(int fd, struct sockaddr_storage const * peer)
+    {
+        struct sockaddr_storage addr;
+        socklen_t len = sizeof(addr);
+        if ( peer != nullptr )
+            addr = *peer;
+        else if ( ::getpeername(fd, reinterpret_cast<struct sockaddr *>(&addr), &len) < 0 )
+            return 0;
+        auto bytes = reinterpret_cast<unsigned char const *>(&reinterpret_cast<struct sockaddr_in *>(&addr)->sin_addr);
+        std::size_t size = sizeof(struct in_addr);
+        if ( addr.ss_family == AF_INET6 ) {
+            bytes = reinterpret_cast<unsigned char const *>(&reinterpret_cast<struct sockaddr_in6 *>(&addr)->sin6_addr);
+            size = sizeof(struct in6_addr);
+        }
+        uint64_t hash = 14695981039346656037ull; // FNV-1a
+        for ( std::size_t i = 0; i < size; ++i )
+            hash = ( hash ^ bytes[i] ) * 1099511628211ull;
+        return hash;
+    }
+
+    // Lamping and Veach's jump consistent hash: growing from n to n + 1
+    // buckets only moves 1 / (n + 1) of the keys.
+    static std::size_t JumpHash(uint64_t key, std::size_t buckets)
+    {
+        int64_t bucket = -1;
+        int64_t next = 0;
+        while ( next < static_cast<int64_t>(buckets) ) {
+            bucket = next;
+            key = key * 2862933555777941757ull + 1;
+            next = static_cast<int64_t>(( bucket + 1 ) * ( double(1ll << 31) / double(( key >> 33 ) + 1) ));
+        }
+        return bucket;
+    }
+
+    // On the owning loop, between batches: stop polling `fd` and queue the
+    // handler for `target` (see Reclaim()). Until it is adopted a write
+    // cannot re-arm the fd; Adopt() arms EPOLLOUT for that.
+    void Detach(int fd, Dispatcher * target)
+    {
+        auto found = _handlers.Find(fd);
+        if ( found == nullptr || found->GetChannel() == nullptr )
+            return;
+        auto handler = _handlers.Take(fd);
+        _connections.fetch_sub(1, std::memory_order_relaxed);
+        CancelTimer(handler->GetChannel()->TakeTimeoutTimer());
+        handler->GetChannel()->SetDemultiplexer(nullptr, handler.get());
+        _demultiplexer.RemoveFd(fd);
+        std::lock_guard<std::mutex> lk(_retireMx);
+        _retired.push_back({ _epoch, std::move(handler), target });
+    }
+
+    // On this loop.
+    void Adopt(std::shared_ptr<Handler> handler)
+    {
+        auto fd = handler->GetHandle();
+        auto channel = handler->GetChannel();
+        if ( _stop || !channel->Active() || !_handlers.Insert(fd, handler) ) {
+            channel->DisableReceive();
+            channel->DisableSend();
+            channel->Inactive();
+            return;
+        }
+        channel->SetDemultiplexer(&_demultiplexer, handler.get());
+        _connections.fetch_add(1, std::memory_order_relaxed);
+        // EPOLLOUT too: a write queued while the fd was between loops could
+        // not arm it. A needless one just finds the buffer empty.
+        _demultiplexer.RegisterFd(fd, _demultiplexer.GetEvents() | EPOLLOUT, handler.get());
+        WatchTimeouts(channel);
+    }
+
+    void SampleRate()
+    {
+        auto events = _eventCount.load(std::memory_order_relaxed);
+        _recentRate.store(( events - _sampledEvents ) * 1000 / RATE_WINDOW.count(), std::memory_order_relaxed);
+        _sampledEvents = events;
     }
 
 private:
-    bool _stop;
+    std::atomic_bool _stop;
     bool _enableSlave;
     int _masterfd;
     Demultiplexer _demultiplexer;
     DispatcherVec _slaves;
     std::vector<struct epoll_event> _events;
-    HandlerMap _handlers;
-    std::vector<int> _waitToRemovedChannel;
-    inline static ChannelMap _allChannel = {};
-    std::mutex _globalMx;
+    HandlerTable _handlers;
+    inline static ChannelTable _allChannel;
     std::mutex _pendingMx;
     server::threadpool::ThreadPool & _pool;
-    std::vector<std::function<void()>> _pendingFn;
+    std::vector<Task> _pendingFn;
+    std::vector<Task> _runningFn; // loop thread only
+    std::atomic_bool _hasPending;
+    std::mutex _lifeMx;
+    bool _running; // Dispatch() is looping, guarded by _lifeMx
+    std::atomic<std::thread::id> _loopThread;
+    std::vector<Task> _batch;
+    std::vector<int> _loopCpus;
+    bool _pinSlaves;
+    ConnectionCallback _onConnection;
+    int _timerfd;
+    TimingWheel _timers;
+    std::mutex _timerMx;
+    TimingWheel::Clock::rep _armedAt; // 0 while disarmed, guarded by _timerMx
+    AcceptHandler * _acceptor;
+    struct Retired
+    {
+        uint64_t epoch;
+        std::shared_ptr<Handler> handler;
+        Dispatcher * target; // migrating there rather than being freed
+    };
+    std::vector<Retired> _retired;
+    std::mutex _retireMx;
+    uint64_t _epoch; // batches collected so far, guarded by _retireMx
+    bool _inlineIo;
+    Dispatcher * _master; // null unless this is a slave
+    std::vector<std::thread> _slaveThreads;
+    std::atomic<uint32_t> _nextSlave;
+    std::atomic<int64_t> _connections;
+    std::atomic<uint64_t> _accepted;
+    std::atomic<uint64_t> _eventCount;
+    std::atomic<uint64_t> _recentRate;
+    uint64_t _sampledEvents; // loop thread only
+    Placement _placement;
+    PlacementPolicy _placementPolicy;
 };
 
 } // namespace reactor
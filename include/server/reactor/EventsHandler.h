@@ -29,10 +29,13 @@ public:
             _channel->DisableSend();
             _channel->DisableReceive();
         }
-        else if ( events & EPOLLIN )
-            _channel->Read();
-        else if ( events & EPOLLOUT )
-            _channel->Write();
+        else
+        {
+            if ( events & EPOLLIN )
+                _channel->Read();
+            if ( events & EPOLLOUT )
+                _channel->Write();
+        }
     }
 
     void SetChannel(std::shared_ptr<Channel> channel) override
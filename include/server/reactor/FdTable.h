@@ -0,0 +1,191 @@
+#ifndef FDTABLE_H
+#define FDTABLE_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace server {
+namespace reactor {
+
+// Map from file descriptor to shared_ptr<T>, indexed directly by the fd.
+// Slots live in fixed-size chunks that are allocated on first use and never
+// move. Each slot mirrors its value in an atomic raw pointer, so Find() is
+// one acquire load with neither hashing nor a lock. The raw pointer does not
+// keep the value alive: Find() suits the loop that owns the fd, which
+// retires what it takes out of the table (Dispatcher::Retire) and frees it
+// only after the batch in flight. Get() hands out shared ownership and so
+// takes the table's mutex, as do inserts and erases, which only happen on
+// connect and close.
+//
+// Every insert bumps the slot's generation. A caller that remembers the
+// generation it saw can later tell a reused fd from the connection it meant.
+template<typename T>
+class FdTable
+{
+public:
+    constexpr static std::size_t CHUNK_SIZE = 1024;
+    constexpr static std::size_t MAX_CHUNKS = 1024; // fds below 1M
+
+    typedef std::shared_ptr<T> Pointer;
+
+public:
+    FdTable()
+        : _chunks()
+          , _mx()
+    {
+        for ( auto & chunk : _chunks )
+            chunk.store(nullptr, std::memory_order_relaxed);
+    }
+
+    FdTable(FdTable &&) = delete;
+    FdTable(const FdTable &) = delete;
+    FdTable &operator=(FdTable &&) = delete;
+    FdTable &operator=(const FdTable &) = delete;
+
+    ~FdTable()
+    {
+        for ( auto & chunk : _chunks )
+            delete[] chunk.load(std::memory_order_relaxed);
+    }
+
+    // Fails if the fd is out of range or already holds a value.
+    bool Insert(int fd, Pointer value)
+    {
+        std::lock_guard<std::mutex> lk(_mx);
+        auto slot = At(fd, true);
+        if ( slot == nullptr || slot->value )
+            return false;
+        slot->generation.fetch_add(1, std::memory_order_release);
+        slot->value = std::move(value);
+        slot->raw.store(slot->value.get(), std::memory_order_release);
+        return true;
+    }
+
+    // Lock-free; see above for how long the result stays valid.
+    T * Find(int fd) const
+    {
+        auto slot = At(fd);
+        return slot ? slot->raw.load(std::memory_order_acquire) : nullptr;
+    }
+
+    // Null unless the slot still holds what was inserted at `generation`.
+    T * Find(int fd, uint32_t generation) const
+    {
+        auto slot = At(fd);
+        if ( slot == nullptr )
+            return nullptr;
+        auto value = slot->raw.load(std::memory_order_acquire);
+        return slot->generation.load(std::memory_order_acquire) == generation ? value : nullptr;
+    }
+
+    Pointer Get(int fd) const
+    {
+        std::lock_guard<std::mutex> lk(_mx);
+        auto slot = At(fd);
+        return slot ? slot->value : nullptr;
+    }
+
+    Pointer Get(int fd, uint32_t generation) const
+    {
+        std::lock_guard<std::mutex> lk(_mx);
+        auto slot = At(fd);
+        if ( slot == nullptr || slot->generation.load(std::memory_order_relaxed) != generation )
+            return nullptr;
+        return slot->value;
+    }
+
+    uint32_t Generation(int fd) const
+    {
+        auto slot = At(fd);
+        return slot ? slot->generation.load(std::memory_order_acquire) : 0;
+    }
+
+    // Removes and returns the value, null if there was none.
+    Pointer Take(int fd)
+    {
+        std::lock_guard<std::mutex> lk(_mx);
+        auto slot = At(fd);
+        if ( slot == nullptr )
+            return nullptr;
+        slot->raw.store(nullptr, std::memory_order_release);
+        return std::move(slot->value);
+    }
+
+    bool Erase(int fd) { return Take(fd) != nullptr; }
+
+    // Visits a snapshot of the occupied slots, taken under the mutex; `fn`
+    // runs without it and may modify the table.
+    template<typename Fn>
+    void ForEach(Fn && fn) const
+    {
+        std::vector<std::pair<int, Pointer>> values;
+        {
+            std::lock_guard<std::mutex> lk(_mx);
+            for ( std::size_t c = 0; c < MAX_CHUNKS; ++c ) {
+                auto chunk = _chunks[c].load(std::memory_order_relaxed);
+                if ( chunk == nullptr )
+                    continue;
+                for ( std::size_t i = 0; i < CHUNK_SIZE; ++i )
+                    if ( chunk[i].value )
+                        values.emplace_back(static_cast<int>(c * CHUNK_SIZE + i), chunk[i].value);
+            }
+        }
+        for ( auto & entry : values )
+            fn(entry.first, entry.second);
+    }
+
+    void Clear()
+    {
+        std::vector<Pointer> values; // released after the lock
+        std::lock_guard<std::mutex> lk(_mx);
+        for ( auto & c : _chunks ) {
+            auto chunk = c.load(std::memory_order_relaxed);
+            if ( chunk == nullptr )
+                continue;
+            for ( std::size_t i = 0; i < CHUNK_SIZE; ++i ) {
+                chunk[i].raw.store(nullptr, std::memory_order_release);
+                if ( chunk[i].value )
+                    values.push_back(std::move(chunk[i].value));
+            }
+        }
+    }
+
+private:
+    struct Slot
+    {
+        std::atomic<T *> raw{nullptr};
+        Pointer value; // guarded by _mx
+        std::atomic<uint32_t> generation{0};
+    };
+
+    // Allocating requires _mx.
+    Slot * At(int fd, bool allocate = false) const
+    {
+        if ( fd < 0 || static_cast<std::size_t>(fd) >= CHUNK_SIZE * MAX_CHUNKS )
+            return nullptr;
+        auto & entry = _chunks[fd / CHUNK_SIZE];
+        auto chunk = entry.load(std::memory_order_acquire);
+        if ( chunk == nullptr ) {
+            if ( !allocate )
+                return nullptr;
+            chunk = new Slot[CHUNK_SIZE];
+            entry.store(chunk, std::memory_order_release);
+        }
+        return &chunk[fd % CHUNK_SIZE];
+    }
+
+private:
+    mutable std::array<std::atomic<Slot *>, MAX_CHUNKS> _chunks;
+    mutable std::mutex _mx;
+};
+
+} // namespace reactor
+} // namespace server
+
+#endif // !FDTABLE_H
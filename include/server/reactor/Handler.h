@@ -8,7 +8,9 @@ namespace reactor {
 
 class Channel;
 
-class Handler {
+// Handlers are owned through shared_ptr; shared_from_this() lets the
+// dispatcher hand one to a worker straight from the epoll event.
+class Handler : public std::enable_shared_from_this<Handler> {
 public:
     Handler() = default;
     Handler(Handler &&) = default;
@@ -20,6 +22,12 @@ public:
     virtual void HandleEvent(uint32_t event) =0;
     virtual void SetChannel(std::shared_ptr<Channel> channel) =0;
     virtual std::shared_ptr<Channel> GetChannel() =0;
+
+    int GetHandle() const { return _fd; }
+    void SetHandle(int fd) { _fd = fd; }
+
+private:
+    int _fd = -1;
 };
 
 } // namespace reactor
@@ -0,0 +1,340 @@
+#ifndef IOURING_H
+#define IOURING_H
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <linux/io_uring.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+namespace server {
+namespace reactor {
+
+// Minimal io_uring ring driven by the raw syscalls, so the library keeps
+// needing nothing beyond the kernel headers. One thread owns it: SQEs are
+// written, submitted and reaped by the loop that created the ring.
+//
+// Optionally carries one provided-buffer ring, which multishot receives
+// pick their buffers from.
+class IoUring
+{
+public:
+    IoUring()
+        : _fd(-1)
+          , _features(0)
+          , _sqpoll(false)
+          , _sqRing(nullptr)
+          , _sqRingSize(0)
+          , _cqRing(nullptr)
+          , _cqRingSize(0)
+          , _sqes(nullptr)
+          , _sqesSize(0)
+          , _sqHead(nullptr)
+          , _sqTail(nullptr)
+          , _sqMask(0)
+          , _sqEntries(0)
+          , _sqFlags(nullptr)
+          , _cqHead(nullptr)
+          , _cqTail(nullptr)
+          , _cqMask(0)
+          , _cqes(nullptr)
+          , _sqLocalTail(0)
+          , _bufRing(nullptr)
+          , _bufRingSize(0)
+          , _bufBase(nullptr)
+          , _bufCount(0)
+          , _bufSize(0)
+          , _bufTail(0)
+          , _bufAdded(0)
+    {}
+
+    IoUring(IoUring &&) = delete;
+    IoUring(const IoUring &) = delete;
+    IoUring &operator=(IoUring &&) = delete;
+    IoUring &operator=(const IoUring &) = delete;
+    ~IoUring() { Shutdown(); }
+
+    // Multishot receive with provided buffer rings needs Linux 6.0, and
+    // waiting with a timeout needs IORING_FEAT_EXT_ARG.
+    static bool Supported()
+    {
+        struct utsname name;
+        int major = 0, minor = 0;
+        if ( ::uname(&name) < 0 || std::sscanf(name.release, "%d.%d", &major, &minor) != 2 || major < 6 )
+            return false;
+        IoUring probe;
+        return probe.Init(2, 2, false) && ( probe._features & IORING_FEAT_EXT_ARG );
+    }
+
+    bool Init(unsigned entries, unsigned cqEntries, bool sqpoll)
+    {
+        struct io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = cqEntries;
+        if ( sqpoll ) {
+            params.flags |= IORING_SETUP_SQPOLL;
+            params.sq_thread_idle = 50; // ms before the poller sleeps
+        }
+        _fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+        if ( _fd < 0 )
+            return false;
+        _features = params.features;
+        _sqpoll = sqpoll;
+
+        _sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        _cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        if ( _features & IORING_FEAT_SINGLE_MMAP ) {
+            _sqRingSize = _cqRingSize = std::max(_sqRingSize, _cqRingSize);
+        }
+        _sqRing = Map(_sqRingSize, IORING_OFF_SQ_RING);
+        if ( _sqRing == nullptr ) {
+            Shutdown();
+            return false;
+        }
+        if ( _features & IORING_FEAT_SINGLE_MMAP ) {
+            _cqRing = _sqRing;
+        } else if ( ( _cqRing = Map(_cqRingSize, IORING_OFF_CQ_RING) ) == nullptr ) {
+            Shutdown();
+            return false;
+        }
+        _sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+        _sqes = static_cast<struct io_uring_sqe *>(Map(_sqesSize, IORING_OFF_SQES));
+        if ( _sqes == nullptr ) {
+            Shutdown();
+            return false;
+        }
+
+        auto sq = static_cast<char *>(_sqRing);
+        _sqHead = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+        _sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        _sqMask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        _sqEntries = params.sq_entries;
+        _sqFlags = reinterpret_cast<unsigned *>(sq + params.sq_off.flags);
+        // SQE i always sits in slot i.
+        auto array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        for ( unsigned i = 0; i < _sqEntries; ++i )
+            array[i] = i;
+
+        auto cq = static_cast<char *>(_cqRing);
+        _cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        _cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        _cqMask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        _cqes = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    bool Valid() const { return _fd >= 0; }
+
+    // Zeroed SQE to fill in, submitted with the next Enter(). Null when the
+    // submission queue is still full after flushing it.
+    struct io_uring_sqe * GetSqe()
+    {
+        if ( !Valid() )
+            return nullptr;
+        if ( _sqLocalTail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) >= _sqEntries ) {
+            Enter(0, 0, _sqpoll ? IORING_ENTER_SQ_WAIT : 0);
+            if ( _sqLocalTail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) >= _sqEntries )
+                return nullptr;
+        }
+        auto sqe = &_sqes[_sqLocalTail++ & _sqMask];
+        std::memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    // Submits what GetSqe() handed out and waits for `waitNr` completions,
+    // at most `timeout` milliseconds; -1 waits indefinitely. Makes no
+    // syscall when there is nothing to submit or wait for.
+    int Enter(unsigned waitNr, int timeout, unsigned flags = 0)
+    {
+        if ( !Valid() )
+            return -1;
+        // Filled SQEs become visible to the kernel only here.
+        unsigned toSubmit = _sqLocalTail - *_sqTail;
+        __atomic_store_n(_sqTail, _sqLocalTail, __ATOMIC_RELEASE);
+        if ( _sqpoll ) {
+            // The kernel thread picks up new SQEs itself unless it went idle.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if ( __atomic_load_n(_sqFlags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP )
+                flags |= IORING_ENTER_SQ_WAKEUP;
+            toSubmit = 0;
+        }
+        if ( __atomic_load_n(_sqFlags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW )
+            flags |= IORING_ENTER_GETEVENTS;
+        if ( waitNr > 0 )
+            flags |= IORING_ENTER_GETEVENTS;
+        if ( toSubmit == 0 && flags == 0 )
+            return 0;
+
+        struct __kernel_timespec ts;
+        struct io_uring_getevents_arg arg;
+        void * argp = nullptr;
+        std::size_t argsz = 0;
+        if ( waitNr > 0 && timeout >= 0 ) {
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = ( timeout % 1000 ) * 1000000ll;
+            std::memset(&arg, 0, sizeof(arg));
+            arg.sigmask_sz = _NSIG / 8;
+            arg.ts = reinterpret_cast<uint64_t>(&ts);
+            argp = &arg;
+            argsz = sizeof(arg);
+            flags |= IORING_ENTER_EXT_ARG;
+        }
+        int ret;
+        do {
+            ret = static_cast<int>(::syscall(__NR_io_uring_enter, _fd, toSubmit, waitNr, flags, argp, argsz));
+        } while ( ret < 0 && errno == EINTR && waitNr == 0 );
+        return ret;
+    }
+
+    bool HasCompletions() const
+    {
+        return Valid() && *_cqHead != __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+    }
+
+    // Hands every available CQE to `fn`, then releases their slots.
+    template<typename Fn>
+    unsigned ForEachCompletion(Fn && fn)
+    {
+        if ( !Valid() )
+            return 0;
+        auto head = *_cqHead;
+        auto tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+        for ( auto i = head; i != tail; ++i )
+            fn(_cqes[i & _cqMask]);
+        __atomic_store_n(_cqHead, tail, __ATOMIC_RELEASE);
+        return tail - head;
+    }
+
+    // Registers `count` (a power of two) buffers of `size` bytes as group
+    // `group` and hands them all to the kernel.
+    bool SetupBuffers(unsigned count, unsigned size, uint16_t group)
+    {
+        if ( !Valid() || count == 0 || ( count & ( count - 1 ) ) )
+            return false;
+        _bufRingSize = count * sizeof(struct io_uring_buf);
+        auto ring = ::mmap(nullptr, _bufRingSize, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if ( ring == MAP_FAILED )
+            return false;
+        _bufRing = static_cast<struct io_uring_buf *>(ring);
+        _bufBase = static_cast<char *>(::mmap(nullptr, std::size_t(count) * size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0));
+        if ( _bufBase == MAP_FAILED ) {
+            _bufBase = nullptr;
+            ReleaseBuffers();
+            return false;
+        }
+        _bufCount = count;
+        _bufSize = size;
+
+        struct io_uring_buf_reg reg;
+        std::memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = reinterpret_cast<uint64_t>(_bufRing);
+        reg.ring_entries = count;
+        reg.bgid = group;
+        if ( ::syscall(__NR_io_uring_register, _fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0 ) {
+            ReleaseBuffers();
+            return false;
+        }
+        for ( unsigned i = 0; i < count; ++i )
+            ReturnBuffer(static_cast<uint16_t>(i));
+        PublishBuffers();
+        return true;
+    }
+
+    char * Buffer(uint16_t bid) const { return _bufBase + std::size_t(bid) * _bufSize; }
+
+    // Gives a consumed buffer back; the kernel sees it after PublishBuffers().
+    void ReturnBuffer(uint16_t bid)
+    {
+        auto & buf = _bufRing[( _bufTail + _bufAdded ) & ( _bufCount - 1 )];
+        buf.addr = reinterpret_cast<uint64_t>(Buffer(bid));
+        buf.len = _bufSize;
+        buf.bid = bid;
+        ++_bufAdded;
+    }
+
+    void PublishBuffers()
+    {
+        if ( _bufAdded == 0 )
+            return;
+        _bufTail += _bufAdded;
+        _bufAdded = 0;
+        // The ring's tail overlays the reserved field of its first entry.
+        __atomic_store_n(&_bufRing[0].resv, _bufTail, __ATOMIC_RELEASE);
+    }
+
+    void Shutdown()
+    {
+        if ( _fd >= 0 )
+            ::close(_fd);
+        _fd = -1;
+        ReleaseBuffers();
+        if ( _sqes )
+            ::munmap(_sqes, _sqesSize);
+        if ( _cqRing && _cqRing != _sqRing )
+            ::munmap(_cqRing, _cqRingSize);
+        if ( _sqRing )
+            ::munmap(_sqRing, _sqRingSize);
+        _sqes = nullptr;
+        _sqRing = _cqRing = nullptr;
+    }
+
+private:
+    void * Map(std::size_t size, uint64_t offset)
+    {
+        auto ptr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, offset);
+        return ptr == MAP_FAILED ? nullptr : ptr;
+    }
+
+    void ReleaseBuffers()
+    {
+        if ( _bufBase )
+            ::munmap(_bufBase, std::size_t(_bufCount) * _bufSize);
+        if ( _bufRing )
+            ::munmap(_bufRing, _bufRingSize);
+        _bufBase = nullptr;
+        _bufRing = nullptr;
+    }
+
+private:
+    int _fd;
+    uint32_t _features;
+    bool _sqpoll;
+    void * _sqRing;
+    std::size_t _sqRingSize;
+    void * _cqRing;
+    std::size_t _cqRingSize;
+    struct io_uring_sqe * _sqes;
+    std::size_t _sqesSize;
+    unsigned * _sqHead;
+    unsigned * _sqTail;
+    unsigned _sqMask;
+    unsigned _sqEntries;
+    unsigned * _sqFlags;
+    unsigned * _cqHead;
+    unsigned * _cqTail;
+    unsigned _cqMask;
+    struct io_uring_cqe * _cqes;
+    unsigned _sqLocalTail; // handed out by GetSqe(), ahead of *_sqTail
+    struct io_uring_buf * _bufRing;
+    std::size_t _bufRingSize;
+    char * _bufBase;
+    unsigned _bufCount;
+    unsigned _bufSize;
+    uint16_t _bufTail;
+    uint16_t _bufAdded;
+};
+
+} // namespace reactor
+} // namespace server
+
+#endif // !IOURING_H
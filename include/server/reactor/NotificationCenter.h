@@ -3,6 +3,7 @@
 
 #include "Dispatcher.h"
 #include "Channel.h"
+#include "server/threadpool/Future.h"
 #include "server/threadpool/ThreadPool.h"
 #include <atomic>
 #include <future>
@@ -31,6 +32,7 @@ public:
           , _dispatcher(dpr)
           , _channelMap(dpr.GetAllChannel())
           , _waitToHandleFD()
+          , _generations()
           , _pool(dpr.GetThreadPool())
     {
         Channel::SetDataReadyNotify([this] (int fd) { NotifyDataReady(fd); });
@@ -65,6 +67,15 @@ public:
         while ( !_barrier.exchange(false, std::memory_order_acq_rel) ) ;
     }
 
+    // The generation of the connection whose data was last drained for
+    // `fd`, for replies addressed with NotifyResponseReady(fd, generation, ...).
+    uint32_t Generation(int fd)
+    {
+        std::lock_guard<std::mutex> lk(_mx);
+        auto it = _generations.find(fd);
+        return it == _generations.end() ? _dispatcher.ChannelGeneration(fd) : it->second;
+    }
+
     void NotifyClose(int fd)
     {
         std::lock_guard<std::mutex> lk(_mx);
@@ -72,12 +83,29 @@ public:
             _waitToHandleFD.erase(fd);
     }
 
-    void NotifyResponseReady(int fd, std::string const & data)
+    // Safe from any thread: the owning loop writes the response. Taken by
+    // value and moved along, so an rvalue response is never copied. Goes
+    // to the connection whose data was last drained for `fd`; if it has
+    // closed since, the response is dropped.
+    void NotifyResponseReady(int fd, std::string data)
     {
-        auto channel = _dispatcher.GetChannel(fd);
-        if ( channel == nullptr )
-            return;
-        channel->NotifyWriteEvent(std::move(data));
+        _dispatcher.Send(fd, Generation(fd), std::move(data));
+    }
+
+    // One payload for many connections; each queues a reference to it.
+    void NotifyResponseReady(int fd, SharedBuffer const & data)
+    {
+        _dispatcher.Send(fd, Generation(fd), data);
+    }
+
+    void NotifyResponseReady(int fd, uint32_t generation, std::string data)
+    {
+        _dispatcher.Send(fd, generation, std::move(data));
+    }
+
+    void NotifyResponseReady(int fd, uint32_t generation, SharedBuffer const & data)
+    {
+        _dispatcher.Send(fd, generation, data);
     }
 
     template<typename Fn,
@@ -87,6 +115,33 @@ public:
         typename R = std::invoke_result_t<std::decay_t<Fn>, FdArg, DataArg, std::decay_t<Args>...>,
         typename = std::enable_if_t<!std::is_void_v<R>>>
     auto HandleReadyData(Fn && fn, Args &&... args)
+    {
+        return DrainReadyData<std::future<R>>([&] (int fd, std::string data) {
+            return _pool.EnqueueTask(server::threadpool::Priority::LOW, fn, fd, std::move(data), args...);
+        });
+    }
+
+    // Same as HandleReadyData, but the results are threadpool::Futures, so
+    // the caller can chain the response with Then() instead of blocking:
+    //
+    //   for ( auto & future : center.HandleReadyDataAsync(Parse) )
+    //       future.Then([&] (Request req) { center.NotifyResponseReady(req.fd, Reply(req)); });
+    template<typename Fn,
+        typename... Args,
+        typename FdArg = int,
+        typename DataArg = std::string,
+        typename R = std::invoke_result_t<std::decay_t<Fn>, FdArg, DataArg, std::decay_t<Args>...>,
+        typename = std::enable_if_t<!std::is_void_v<R>>>
+    auto HandleReadyDataAsync(Fn && fn, Args &&... args)
+    {
+        return DrainReadyData<server::threadpool::Future<R>>([&] (int fd, std::string data) {
+            return server::threadpool::Async(_pool, server::threadpool::Priority::LOW, fn, fd, std::move(data), args...);
+        });
+    }
+
+private:
+    template<typename Result, typename Submit>
+    std::vector<Result> DrainReadyData(Submit && submit)
     {
         std::unordered_map<int, state> copy;
         {
@@ -94,7 +149,7 @@ public:
             copy = _waitToHandleFD;
         }
 
-        std::vector<std::future<R>> result;
+        std::vector<Result> result;
         bool no_more = true;
         result.reserve(copy.size());
         for ( auto & it : copy ) {
@@ -103,8 +158,11 @@ public:
                 continue;
 
             no_more = false;
-            std::future<R> res = _pool.EnqueueTask(std::forward<Fn>(fn), channel->GetHandle(), channel->GetReceivedData(), std::forward<Args>(args)...);
-            result.emplace_back(std::move(res));
+            {
+                std::lock_guard<std::mutex> lk(_mx);
+                _generations[it.first] = channel->Generation();
+            }
+            result.emplace_back(submit(channel->GetHandle(), channel->GetReceivedData()));
             // have been finished the operation for dealing with data
             // std::lock_guard<std::mutex> lk(_mx);
             // lock-free, avoiding compietition
@@ -133,8 +191,9 @@ public:
 private:
     std::mutex _mx;
     Dispatcher & _dispatcher;
-    Dispatcher::ChannelMap & _channelMap;
+    Dispatcher::ChannelTable & _channelMap;
     std::unordered_map<int, state> _waitToHandleFD;;
+    std::unordered_map<int, uint32_t> _generations; // guarded by _mx
     server::threadpool::ThreadPool & _pool;
     std::atomic_bool _barrier;
 };
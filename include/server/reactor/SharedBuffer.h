@@ -0,0 +1,63 @@
+#ifndef SHAREDBUFFER_H
+#define SHAREDBUFFER_H
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace server {
+namespace reactor {
+
+// Immutable bytes with a refcounted owner. Copies and slices share the
+// bytes, so one payload can be queued on many connections; a send chain
+// links them instead of copying and holds the owner until they are sent.
+class SharedBuffer
+{
+public:
+    SharedBuffer()
+        : _owner()
+          , _data(nullptr)
+          , _size(0)
+    {}
+
+    explicit SharedBuffer(std::string data)
+    {
+        auto owner = std::make_shared<std::string const>(std::move(data));
+        _data = owner->data();
+        _size = owner->size();
+        _owner = std::move(owner);
+    }
+
+    // `data` must stay valid and unchanged as long as `owner` lives.
+    SharedBuffer(std::string_view data, std::shared_ptr<void const> owner)
+        : _owner(std::move(owner))
+          , _data(data.data())
+          , _size(data.size())
+    {}
+
+    char const * Data() const { return _data; }
+    std::size_t Size() const { return _size; }
+    bool Empty() const { return _size == 0; }
+    std::string_view View() const { return std::string_view(_data, _size); }
+    std::shared_ptr<void const> const & Owner() const { return _owner; }
+
+    // Shares the same owner.
+    SharedBuffer Slice(std::size_t offset, std::size_t size = std::string::npos) const
+    {
+        offset = std::min(offset, _size);
+        return SharedBuffer(View().substr(offset, size), _owner);
+    }
+
+private:
+    std::shared_ptr<void const> _owner;
+    char const * _data;
+    std::size_t _size;
+};
+
+} // namespace reactor
+} // namespace server
+
+#endif // !SHAREDBUFFER_H
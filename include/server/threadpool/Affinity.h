@@ -0,0 +1,164 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <pthread.h>
+#include <sched.h>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace server {
+namespace threadpool {
+
+// How workers are laid out over the allowed CPUs.
+enum class Placement : uint8_t {
+    NONE,   // no per-worker pinning (a non-empty cpu_set still bounds all of them)
+    SPREAD, // one CPU per worker, round-robin across NUMA nodes
+    PACK,   // one CPU per worker, filling one NUMA node before the next
+};
+
+// NUMA nodes and the CPUs they own, read once from sysfs. Machines without
+// /sys/devices/system/node are treated as a single node.
+class CpuTopology
+{
+public:
+    static CpuTopology const & Get()
+    {
+        static CpuTopology topology;
+        return topology;
+    }
+
+    std::vector<std::vector<int>> const & Nodes() const { return _nodes; }
+
+    // Node owning `cpu`, -1 if unknown.
+    int NodeOf(int cpu) const
+    {
+        for ( std::size_t i = 0; i < _nodes.size(); ++i )
+            if ( std::find(_nodes[i].begin(), _nodes[i].end(), cpu) != _nodes[i].end() )
+                return static_cast<int>(i);
+        return -1;
+    }
+
+    std::vector<int> NodeCpus(int node) const
+    {
+        if ( node < 0 || static_cast<std::size_t>(node) >= _nodes.size() )
+            return {};
+        return _nodes[node];
+    }
+
+    // CPU order in which workers are placed. `allowed` restricts it, empty
+    // means every CPU this process may run on.
+    std::vector<int> Order(Placement placement, std::vector<int> const & allowed) const
+    {
+        std::vector<std::vector<int>> nodes;
+        for ( auto & node : _nodes ) {
+            std::vector<int> cpus;
+            for ( auto cpu : node )
+                if ( allowed.empty() || std::find(allowed.begin(), allowed.end(), cpu) != allowed.end() )
+                    cpus.emplace_back(cpu);
+            if ( !cpus.empty() )
+                nodes.emplace_back(std::move(cpus));
+        }
+
+        std::vector<int> order;
+        if ( placement == Placement::PACK ) {
+            for ( auto & node : nodes )
+                order.insert(order.end(), node.begin(), node.end());
+        } else {
+            for ( std::size_t i = 0; order.size() < Count(nodes); ++i )
+                for ( auto & node : nodes )
+                    if ( i < node.size() )
+                        order.emplace_back(node[i]);
+        }
+        return order;
+    }
+
+    // Parses the kernel's cpulist format, e.g. "0-3,8,10-11".
+    static std::vector<int> ParseCpuList(std::string const & list)
+    {
+        std::vector<int> cpus;
+        std::stringstream ss(list);
+        std::string range;
+        while ( std::getline(ss, range, ',') ) {
+            if ( range.empty() || range == "\n" )
+                continue;
+            auto dash = range.find('-');
+            int lo = std::stoi(range.substr(0, dash));
+            int hi = dash == std::string::npos ? lo : std::stoi(range.substr(dash + 1));
+            for ( int cpu = lo; cpu <= hi; ++cpu )
+                cpus.emplace_back(cpu);
+        }
+        return cpus;
+    }
+
+private:
+    CpuTopology()
+        : _nodes()
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        bool masked = ::sched_getaffinity(0, sizeof(set), &set) == 0;
+
+        for ( int node = 0; ; ++node ) {
+            std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            if ( !file.is_open() )
+                break;
+            std::string line;
+            std::getline(file, line);
+            std::vector<int> cpus;
+            for ( auto cpu : ParseCpuList(line) )
+                if ( !masked || CPU_ISSET(cpu, &set) )
+                    cpus.emplace_back(cpu);
+            _nodes.emplace_back(std::move(cpus));
+        }
+
+        if ( Count(_nodes) == 0 ) {
+            _nodes.assign(1, {});
+            for ( int cpu = 0; cpu < CPU_SETSIZE; ++cpu )
+                if ( masked ? CPU_ISSET(cpu, &set) : cpu == 0 )
+                    _nodes[0].emplace_back(cpu);
+        }
+    }
+
+    static std::size_t Count(std::vector<std::vector<int>> const & nodes)
+    {
+        std::size_t count = 0;
+        for ( auto & node : nodes )
+            count += node.size();
+        return count;
+    }
+
+private:
+    std::vector<std::vector<int>> _nodes;
+};
+
+inline bool PinThread(pthread_t thread, std::vector<int> const & cpus)
+{
+    if ( cpus.empty() )
+        return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for ( auto cpu : cpus )
+        if ( cpu >= 0 && cpu < CPU_SETSIZE )
+            CPU_SET(cpu, &set);
+    return ::pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+}
+
+inline bool PinCurrentThread(std::vector<int> const & cpus) { return PinThread(::pthread_self(), cpus); }
+
+// Linux limits thread names to 15 characters, longer ones are cut.
+inline bool SetCurrentThreadName(std::string const & name)
+{
+    if ( name.empty() )
+        return false;
+    return ::pthread_setname_np(::pthread_self(), name.substr(0, 15).c_str()) == 0;
+}
+
+} // namespace threadpool
+} // namespace server
+
+#endif // !AFFINITY_H
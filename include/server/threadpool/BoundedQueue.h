@@ -0,0 +1,150 @@
+#ifndef BOUNDEDQUEUE_H
+#define BOUNDEDQUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+namespace server {
+namespace threadpool {
+
+// Bounded multi-producer/multi-consumer ring buffer (Vyukov). Every cell
+// carries a sequence number telling producers and consumers whose turn it
+// is, so the only shared writes are one CAS on the head or the tail.
+template<typename T>
+class BoundedQueue
+{
+    constexpr static std::size_t CACHELINE = 64;
+
+    struct Cell
+    {
+        std::atomic<std::size_t> sequence;
+        T data;
+    };
+
+public:
+    explicit BoundedQueue(std::size_t capacity)
+        : _mask(RoundUp(capacity) - 1)
+          , _buffer(new Cell[_mask + 1])
+          , _enqueuePos(0)
+          , _dequeuePos(0)
+    {
+        for ( std::size_t i = 0; i <= _mask; ++i )
+            _buffer[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    BoundedQueue(BoundedQueue const &) = delete;
+    BoundedQueue & operator=(BoundedQueue const &) = delete;
+    ~BoundedQueue() = default;
+
+    // Moves from `item` only when it was accepted.
+    bool TryPush(T & item)
+    {
+        Cell * cell;
+        std::size_t pos = _enqueuePos.load(std::memory_order_relaxed);
+        while ( true ) {
+            cell = &_buffer[pos & _mask];
+            std::size_t seq = cell->sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+            if ( diff == 0 ) {
+                if ( _enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed) )
+                    break;
+            } else if ( diff < 0 ) {
+                return false;
+            } else {
+                pos = _enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+        cell->data = std::move(item);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Claims up to `n` consecutive free cells with a single CAS and moves
+    // the leading items into them. Returns how many were accepted.
+    template<typename It>
+    std::size_t TryPushBatch(It first, std::size_t n)
+    {
+        std::size_t pos = _enqueuePos.load(std::memory_order_relaxed);
+        std::size_t count = 0;
+        while ( true ) {
+            count = 0;
+            while ( count < n && count <= _mask ) {
+                auto seq = _buffer[(pos + count) & _mask].sequence.load(std::memory_order_acquire);
+                if ( seq != pos + count )
+                    break;
+                ++count;
+            }
+            if ( count == 0 ) {
+                auto seq = _buffer[pos & _mask].sequence.load(std::memory_order_acquire);
+                if ( static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos) < 0 )
+                    return 0;
+                pos = _enqueuePos.load(std::memory_order_relaxed);
+                continue;
+            }
+            if ( _enqueuePos.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed) )
+                break;
+        }
+        for ( std::size_t i = 0; i < count; ++i, ++first ) {
+            auto & cell = _buffer[(pos + i) & _mask];
+            cell.data = std::move(*first);
+            cell.sequence.store(pos + i + 1, std::memory_order_release);
+        }
+        return count;
+    }
+
+    bool TryPop(T & item)
+    {
+        Cell * cell;
+        std::size_t pos = _dequeuePos.load(std::memory_order_relaxed);
+        while ( true ) {
+            cell = &_buffer[pos & _mask];
+            std::size_t seq = cell->sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos + 1);
+            if ( diff == 0 ) {
+                if ( _dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed) )
+                    break;
+            } else if ( diff < 0 ) {
+                return false;
+            } else {
+                pos = _dequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+        item = std::move(cell->data);
+        cell->sequence.store(pos + _mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Approximate under concurrent use.
+    std::size_t Size() const
+    {
+        auto tail = _enqueuePos.load(std::memory_order_acquire);
+        auto head = _dequeuePos.load(std::memory_order_acquire);
+        return tail > head ? tail - head : 0;
+    }
+
+    bool Empty() const { return Size() == 0; }
+
+    std::size_t Capacity() const { return _mask + 1; }
+
+private:
+    static std::size_t RoundUp(std::size_t n)
+    {
+        std::size_t size = 2;
+        while ( size < n )
+            size <<= 1;
+        return size;
+    }
+
+private:
+    std::size_t const _mask;
+    std::unique_ptr<Cell[]> const _buffer;
+    alignas(CACHELINE) std::atomic<std::size_t> _enqueuePos;
+    alignas(CACHELINE) std::atomic<std::size_t> _dequeuePos;
+};
+
+} // namespace threadpool
+} // namespace server
+
+#endif // !BOUNDEDQUEUE_H
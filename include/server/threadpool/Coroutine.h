@@ -0,0 +1,233 @@
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+// C++20 coroutine support. The rest of the library stays C++17, so this
+// header is empty unless the translation unit is built with coroutines.
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include "server/logging/Logging.h"
+#include "Task.h"
+#include "ThreadPool.h"
+#include "TimingWheel.h"
+
+namespace server {
+namespace threadpool {
+
+template<typename T = void>
+class Coroutine;
+
+namespace detail {
+
+class PromiseBase
+{
+public:
+    struct FinalAwaiter
+    {
+        bool await_ready() const noexcept { return false; }
+
+        template<typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+        {
+            auto & promise = handle.promise();
+            if ( promise._continuation )
+                return promise._continuation;
+            if ( promise._detached )
+                handle.destroy();
+            return std::noop_coroutine();
+        }
+
+        void await_resume() const noexcept {}
+    };
+
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    FinalAwaiter final_suspend() const noexcept { return {}; }
+
+    void unhandled_exception()
+    {
+        if ( _detached ) {
+            try {
+                throw;
+            } catch ( std::exception const & e ) {
+                LOG(ERROR) << "Detached coroutine exited with exception: " << e.what();
+            } catch ( ... ) {
+                LOG(ERROR) << "Detached coroutine exited with unknown exception";
+            }
+            return;
+        }
+        _error = std::current_exception();
+    }
+
+    void SetContinuation(std::coroutine_handle<> continuation) { _continuation = continuation; }
+    void Detach() { _detached = true; }
+
+protected:
+    std::coroutine_handle<> _continuation;
+    std::exception_ptr _error;
+    bool _detached = false;
+};
+
+template<typename T>
+class CoroutinePromise : public PromiseBase
+{
+public:
+    Coroutine<T> get_return_object();
+
+    template<typename V>
+    void return_value(V && value) { _value.emplace(std::forward<V>(value)); }
+
+    T Result()
+    {
+        if ( _error )
+            std::rethrow_exception(_error);
+        return std::move(*_value);
+    }
+
+private:
+    std::optional<T> _value;
+};
+
+template<>
+class CoroutinePromise<void> : public PromiseBase
+{
+public:
+    Coroutine<void> get_return_object();
+
+    void return_void() const noexcept {}
+
+    void Result()
+    {
+        if ( _error )
+            std::rethrow_exception(_error);
+    }
+};
+
+} // namespace detail
+
+// Lazily started coroutine. `co_await` it from another coroutine to run it
+// and get its result; Spawn() it to run it detached. Resumption hops to
+// whatever thread completes the awaited operation, so a coroutine that
+// needs a particular executor should `co_await pool.Schedule()`.
+template<typename T>
+class [[nodiscard]] Coroutine
+{
+public:
+    typedef detail::CoroutinePromise<T> promise_type;
+    typedef std::coroutine_handle<promise_type> Handle;
+
+    Coroutine(Coroutine && other) noexcept
+        : _handle(std::exchange(other._handle, nullptr))
+    {}
+
+    Coroutine & operator=(Coroutine && other) noexcept
+    {
+        if ( this != &other ) {
+            if ( _handle )
+                _handle.destroy();
+            _handle = std::exchange(other._handle, nullptr);
+        }
+        return *this;
+    }
+
+    Coroutine(Coroutine const &) = delete;
+    Coroutine & operator=(Coroutine const &) = delete;
+
+    ~Coroutine()
+    {
+        if ( _handle )
+            _handle.destroy();
+    }
+
+    bool await_ready() const noexcept { return !_handle || _handle.done(); }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+    {
+        _handle.promise().SetContinuation(awaiting);
+        return _handle;
+    }
+
+    T await_resume() { return _handle.promise().Result(); }
+
+    // Starts the coroutine on the calling thread and gives up ownership; the
+    // frame frees itself when it finishes.
+    void Detach() &&
+    {
+        auto handle = std::exchange(_handle, nullptr);
+        handle.promise().Detach();
+        handle.resume();
+    }
+
+private:
+    friend promise_type;
+
+    explicit Coroutine(Handle handle)
+        : _handle(handle)
+    {}
+
+private:
+    Handle _handle;
+};
+
+namespace detail {
+
+template<typename T>
+Coroutine<T> CoroutinePromise<T>::get_return_object()
+{
+    return Coroutine<T>(std::coroutine_handle<CoroutinePromise<T>>::from_promise(*this));
+}
+
+inline Coroutine<void> CoroutinePromise<void>::get_return_object()
+{
+    return Coroutine<void>(std::coroutine_handle<CoroutinePromise<void>>::from_promise(*this));
+}
+
+} // namespace detail
+
+// Runs `coroutine` detached, starting on the calling thread.
+inline void Spawn(Coroutine<void> coroutine) { std::move(coroutine).Detach(); }
+
+// `co_await SleepFor(d)` suspends for at least `d` and resumes on `pool`.
+class SleepAwaiter
+{
+public:
+    SleepAwaiter(std::chrono::steady_clock::duration duration, ThreadPool & pool)
+        : _deadline(std::chrono::steady_clock::now() + duration)
+          , _pool(pool)
+    {}
+
+    bool await_ready() const noexcept { return std::chrono::steady_clock::now() >= _deadline; }
+
+    // The shared wheel's driver only hands the coroutine to the pool, so a
+    // sleep never occupies a worker.
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        TimingWheel::GetGlobalTimingWheel().RunAt(_deadline, [pool = &_pool, handle] {
+            if ( !pool->Post([handle] { handle.resume(); }) )
+                handle.resume();
+        });
+    }
+
+    void await_resume() const noexcept {}
+
+private:
+    std::chrono::steady_clock::time_point _deadline;
+    ThreadPool & _pool;
+};
+
+template<typename Rep, typename Period>
+SleepAwaiter SleepFor(std::chrono::duration<Rep, Period> duration, ThreadPool & pool = ThreadPool::GetGlobalThreadPool())
+{
+    return SleepAwaiter(std::chrono::duration_cast<std::chrono::steady_clock::duration>(duration), pool);
+}
+
+} // namespace threadpool
+} // namespace server
+
+#endif
+
+#endif // !COROUTINE_H
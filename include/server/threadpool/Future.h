@@ -0,0 +1,546 @@
+#ifndef FUTURE_H
+#define FUTURE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+#include "Task.h"
+#include "ThreadPool.h"
+
+namespace server {
+namespace threadpool {
+
+template<typename T> class Future;
+template<typename T> class Promise;
+
+namespace detail {
+
+template<typename T>
+struct FutureValue { typedef T type; };
+
+template<>
+struct FutureValue<void> { typedef std::monostate type; };
+
+template<typename T>
+struct IsFuture : std::false_type {};
+
+template<typename T>
+struct IsFuture<Future<T>> : std::true_type { typedef T value_type; };
+
+struct FutureAccess;
+
+// State shared by one Promise and one Future. At most one continuation is
+// attached; it is handed to the pool (or run inline without a pool) once
+// the value or the error is set, never while the lock is held.
+template<typename T>
+class SharedState
+{
+public:
+    typedef typename FutureValue<T>::type Value;
+
+    SharedState(ThreadPool * pool, Priority priority)
+        : _mx()
+          , _cv()
+          , _ready(false)
+          , _value()
+          , _error()
+          , _next()
+          , _inlined(false)
+          , _pool(pool)
+          , _priority(priority)
+    {}
+
+    SharedState(SharedState const &) = delete;
+    SharedState & operator=(SharedState const &) = delete;
+
+    void SetValue(Value value)
+    {
+        Finish([&] { _value.emplace(std::move(value)); });
+    }
+
+    void SetException(std::exception_ptr error)
+    {
+        Finish([&] { _error = std::move(error); });
+    }
+
+    // `inlined` continuations run on the completing thread; keep them to
+    // bookkeeping such as the WhenAll/WhenAny counters.
+    void OnReady(Task task, bool inlined = false)
+    {
+        {
+            std::lock_guard<std::mutex> lk(_mx);
+            if ( !_ready ) {
+                _next = std::move(task);
+                _inlined = inlined;
+                return;
+            }
+        }
+        Dispatch(std::move(task), inlined);
+    }
+
+    bool Ready() const
+    {
+        std::lock_guard<std::mutex> lk(_mx);
+        return _ready;
+    }
+
+    void Wait() const
+    {
+        std::unique_lock<std::mutex> lk(_mx);
+        _cv.wait(lk, [this] { return _ready; });
+    }
+
+    // Only valid once ready. Rethrows the stored error.
+    Value Take()
+    {
+        if ( _error )
+            std::rethrow_exception(_error);
+        return std::move(*_value);
+    }
+
+    std::exception_ptr Error() const { return _error; }
+
+    ThreadPool * Pool() const { return _pool; }
+
+    Priority GetPriority() const { return _priority; }
+
+private:
+    template<typename Set>
+    void Finish(Set && set)
+    {
+        Task next;
+        bool inlined;
+        {
+            std::lock_guard<std::mutex> lk(_mx);
+            if ( _ready )
+                throw std::future_error(std::future_errc::promise_already_satisfied);
+            set();
+            _ready = true;
+            next = std::move(_next);
+            inlined = _inlined;
+        }
+        _cv.notify_all();
+        if ( next )
+            Dispatch(std::move(next), inlined);
+    }
+
+    // A continuation refused by the pool is destroyed with the Promise it
+    // owns, so whoever waits downstream sees broken_promise rather than
+    // hanging.
+    void Dispatch(Task task, bool inlined)
+    {
+        if ( inlined || _pool == nullptr )
+            task();
+        else
+            _pool->Post(_priority, std::move(task));
+    }
+
+private:
+    mutable std::mutex _mx;
+    mutable std::condition_variable _cv;
+    bool _ready;
+    std::optional<Value> _value;
+    std::exception_ptr _error;
+    Task _next;
+    bool _inlined;
+    ThreadPool * const _pool;
+    Priority const _priority;
+};
+
+} // namespace detail
+
+// Non-blocking counterpart of std::future. Then() attaches a continuation
+// that runs on the pool once the value is available, so a pipeline of
+// stages never parks a thread; Get() is still there for the edges.
+template<typename T>
+class Future
+{
+public:
+    typedef T value_type;
+
+    Future() noexcept
+        : _state(nullptr)
+    {}
+
+    Future(Future &&) noexcept = default;
+    Future & operator=(Future &&) noexcept = default;
+    Future(Future const &) = delete;
+    Future & operator=(Future const &) = delete;
+    ~Future() = default;
+
+    bool Valid() const noexcept { return _state != nullptr; }
+
+    bool Ready() const { return _state && _state->Ready(); }
+
+    void Wait() const { _state->Wait(); }
+
+    T Get()
+    {
+        auto state = std::move(_state);
+        state->Wait();
+        if constexpr ( std::is_void_v<T> )
+            state->Take();
+        else
+            return state->Take();
+    }
+
+    // fn(T) (or fn() for Future<void>) runs on the pool with the priority
+    // of the producing task. An error skips fn and is passed on. A
+    // continuation returning Future<U> yields Future<U>, not
+    // Future<Future<U>>. Consumes this future.
+    template<typename Fn>
+    auto Then(Fn && fn)
+    {
+        typedef decltype(Invoke(fn, std::declval<detail::SharedState<T> &>())) R;
+        if constexpr ( detail::IsFuture<R>::value ) {
+            typedef typename detail::IsFuture<R>::value_type U;
+            return Chain<U>(std::forward<Fn>(fn), [] (Promise<U> & next, R inner) {
+                inner.Forward(std::move(next));
+            });
+        } else {
+            return Chain<R>(std::forward<Fn>(fn), [] (Promise<R> & next, auto && ... result) {
+                next.SetValue(std::forward<decltype(result)>(result)...);
+            });
+        }
+    }
+
+private:
+    template<typename U> friend class Future;
+    template<typename U> friend class Promise;
+    friend struct detail::FutureAccess;
+
+    explicit Future(std::shared_ptr<detail::SharedState<T>> state)
+        : _state(std::move(state))
+    {}
+
+    template<typename Fn>
+    static decltype(auto) Invoke(Fn & fn, detail::SharedState<T> & state)
+    {
+        if constexpr ( std::is_void_v<T> )
+            return fn();
+        else
+            return fn(state.Take());
+    }
+
+    template<typename R, typename Fn, typename Deliver>
+    Future<R> Chain(Fn && fn, Deliver deliver)
+    {
+        auto state = std::move(_state);
+        Promise<R> next(state->Pool(), state->GetPriority());
+        auto result = next.GetFuture();
+        state->OnReady([state, next = std::move(next), fn = std::forward<Fn>(fn), deliver] () mutable {
+            if ( auto error = state->Error() ) {
+                next.SetException(error);
+                return;
+            }
+            try {
+                if constexpr ( std::is_void_v<decltype(Invoke(fn, *state))> ) {
+                    Invoke(fn, *state);
+                    deliver(next);
+                } else {
+                    deliver(next, Invoke(fn, *state));
+                }
+            } catch ( ... ) {
+                next.SetException(std::current_exception());
+            }
+        });
+        return result;
+    }
+
+    // Completes `promise` with whatever this future ends up holding.
+    void Forward(Promise<T> promise)
+    {
+        auto state = std::move(_state);
+        state->OnReady([state, promise = std::move(promise)] () mutable {
+            if ( auto error = state->Error() )
+                promise.SetException(error);
+            else if constexpr ( std::is_void_v<T> )
+                promise.SetValue();
+            else
+                promise.SetValue(state->Take());
+        }, true);
+    }
+
+    template<typename Fn>
+    void OnReady(Fn && fn)
+    {
+        auto state = std::move(_state);
+        state->OnReady([state, fn = std::forward<Fn>(fn)] () mutable { fn(*state); }, true);
+    }
+
+private:
+    std::shared_ptr<detail::SharedState<T>> _state;
+};
+
+// Write side. `pool` runs the continuations attached to the future; without
+// one they run on the thread that sets the value. A promise destroyed
+// unsatisfied breaks its future with std::future_errc::broken_promise.
+template<typename T>
+class Promise
+{
+public:
+    explicit Promise(ThreadPool * pool = nullptr, Priority priority = Priority::NORMAL)
+        : _state(std::make_shared<detail::SharedState<T>>(pool, priority))
+          , _retrieved(false)
+    {}
+
+    Promise(Promise && other) noexcept
+        : _state(std::move(other._state))
+          , _retrieved(other._retrieved)
+    {}
+
+    Promise & operator=(Promise && other) noexcept
+    {
+        if ( this != &other ) {
+            Abandon();
+            _state = std::move(other._state);
+            _retrieved = other._retrieved;
+        }
+        return *this;
+    }
+
+    Promise(Promise const &) = delete;
+    Promise & operator=(Promise const &) = delete;
+
+    ~Promise() { Abandon(); }
+
+    Future<T> GetFuture()
+    {
+        if ( _retrieved )
+            throw std::future_error(std::future_errc::future_already_retrieved);
+        _retrieved = true;
+        return Future<T>(_state);
+    }
+
+    template<typename... V>
+    void SetValue(V &&... value)
+    {
+        auto state = Release();
+        if constexpr ( std::is_void_v<T> )
+            state->SetValue({});
+        else
+            state->SetValue(T(std::forward<V>(value)...));
+    }
+
+    void SetException(std::exception_ptr error)
+    {
+        auto state = Release();
+        state->SetException(std::move(error));
+    }
+
+private:
+    std::shared_ptr<detail::SharedState<T>> Release()
+    {
+        if ( !_state )
+            throw std::future_error(std::future_errc::promise_already_satisfied);
+        return std::move(_state);
+    }
+
+    void Abandon()
+    {
+        if ( _state && !_state->Ready() )
+            _state->SetException(std::make_exception_ptr(std::future_error(std::future_errc::broken_promise)));
+        _state.reset();
+    }
+
+private:
+    std::shared_ptr<detail::SharedState<T>> _state;
+    bool _retrieved;
+};
+
+// fn(args...) on `pool`; the result and every continuation attached to it
+// use `priority`. A task refused by the pool yields a broken future.
+template<typename Fn,
+    typename... Args,
+    typename R = std::invoke_result_t<std::decay_t<Fn>, std::decay_t<Args>...>>
+Future<R> Async(ThreadPool & pool, Priority priority, Fn && fn, Args &&... args)
+{
+    Promise<R> promise(&pool, priority);
+    auto result = promise.GetFuture();
+    pool.Post(priority, [promise = std::move(promise), fn = std::forward<Fn>(fn), args = std::make_tuple(std::forward<Args>(args)...)] () mutable {
+        try {
+            if constexpr ( std::is_void_v<R> ) {
+                std::apply(std::move(fn), std::move(args));
+                promise.SetValue();
+            } else {
+                promise.SetValue(std::apply(std::move(fn), std::move(args)));
+            }
+        } catch ( ... ) {
+            promise.SetException(std::current_exception());
+        }
+    });
+    return result;
+}
+
+template<typename Fn,
+    typename... Args,
+    typename = std::enable_if_t<!std::is_same_v<std::decay_t<Fn>, Priority>>>
+auto Async(ThreadPool & pool, Fn && fn, Args &&... args)
+{
+    return Async(pool, Priority::NORMAL, std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
+
+template<typename Fn,
+    typename... Args,
+    typename = std::enable_if_t<!std::is_same_v<std::decay_t<Fn>, Priority>>>
+auto Async(Fn && fn, Args &&... args)
+{
+    return Async(ThreadPool::GetGlobalThreadPool(), Priority::NORMAL, std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
+
+template<typename T>
+Future<std::decay_t<T>> MakeReadyFuture(T && value)
+{
+    Promise<std::decay_t<T>> promise(&ThreadPool::GetGlobalThreadPool());
+    auto result = promise.GetFuture();
+    promise.SetValue(std::forward<T>(value));
+    return result;
+}
+
+inline Future<void> MakeReadyFuture()
+{
+    Promise<void> promise(&ThreadPool::GetGlobalThreadPool());
+    auto result = promise.GetFuture();
+    promise.SetValue();
+    return result;
+}
+
+namespace detail {
+
+// Lets the combinators attach inline continuations.
+struct FutureAccess
+{
+    template<typename T, typename Fn>
+    static void OnReady(Future<T> & future, Fn && fn) { future.OnReady(std::forward<Fn>(fn)); }
+
+    // Where continuations on a combined result run: the first input's pool
+    // and priority, as Then() would use, or the global pool.
+    template<typename T>
+    static ThreadPool * Pool(std::vector<Future<T>> const & futures)
+    {
+        if ( !futures.empty() && futures.front()._state && futures.front()._state->Pool() )
+            return futures.front()._state->Pool();
+        return &ThreadPool::GetGlobalThreadPool();
+    }
+
+    template<typename T>
+    static Priority GetPriority(std::vector<Future<T>> const & futures)
+    {
+        if ( !futures.empty() && futures.front()._state )
+            return futures.front()._state->GetPriority();
+        return Priority::NORMAL;
+    }
+};
+
+template<typename T>
+struct WhenAllState
+{
+    WhenAllState(std::size_t n, ThreadPool * pool, Priority priority)
+        : remaining(n)
+          , failed(false)
+          , values(n)
+          , promise(pool, priority)
+    {}
+
+    std::atomic<std::size_t> remaining;
+    std::atomic_bool failed;
+    std::vector<std::optional<typename FutureValue<T>::type>> values;
+    Promise<std::conditional_t<std::is_void_v<T>, void, std::vector<T>>> promise;
+};
+
+template<typename T>
+struct WhenAnyState
+{
+    WhenAnyState(ThreadPool * pool, Priority priority)
+        : done(false)
+          , promise(pool, priority)
+    {}
+
+    std::atomic_bool done;
+    Promise<std::conditional_t<std::is_void_v<T>, std::size_t, std::pair<std::size_t, T>>> promise;
+};
+
+} // namespace detail
+
+// Ready once every input is, holding their values in input order
+// (Future<void> for void inputs). The first error fails the whole result
+// without waiting for the rest. Consumes the inputs; the bookkeeping runs
+// inline, continuations on the result are scheduled as usual.
+template<typename T>
+auto WhenAll(std::vector<Future<T>> futures)
+{
+    auto state = std::make_shared<detail::WhenAllState<T>>(futures.size(),
+        detail::FutureAccess::Pool(futures), detail::FutureAccess::GetPriority(futures));
+    auto result = state->promise.GetFuture();
+    if ( futures.empty() ) {
+        if constexpr ( std::is_void_v<T> )
+            state->promise.SetValue();
+        else
+            state->promise.SetValue(std::vector<T>());
+        return result;
+    }
+    for ( std::size_t i = 0; i < futures.size(); ++i ) {
+        detail::FutureAccess::OnReady(futures[i], [state, i] (auto & input) {
+            if ( auto error = input.Error() ) {
+                if ( !state->failed.exchange(true) )
+                    state->promise.SetException(error);
+                return;
+            }
+            state->values[i].emplace(input.Take());
+            if ( state->remaining.fetch_sub(1, std::memory_order_acq_rel) != 1 || state->failed )
+                return;
+            if constexpr ( std::is_void_v<T> ) {
+                state->promise.SetValue();
+            } else {
+                std::vector<T> values;
+                values.reserve(state->values.size());
+                for ( auto & value : state->values )
+                    values.emplace_back(std::move(*value));
+                state->promise.SetValue(std::move(values));
+            }
+        });
+    }
+    return result;
+}
+
+// Ready as soon as the first input is, with its index (and value for
+// non-void inputs), or with its error. Later completions are ignored.
+template<typename T>
+auto WhenAny(std::vector<Future<T>> futures)
+{
+    auto state = std::make_shared<detail::WhenAnyState<T>>(
+        detail::FutureAccess::Pool(futures), detail::FutureAccess::GetPriority(futures));
+    auto result = state->promise.GetFuture();
+    if ( futures.empty() ) {
+        state->promise.SetException(std::make_exception_ptr(std::future_error(std::future_errc::no_state)));
+        return result;
+    }
+    for ( std::size_t i = 0; i < futures.size(); ++i ) {
+        detail::FutureAccess::OnReady(futures[i], [state, i] (auto & input) {
+            if ( state->done.exchange(true) )
+                return;
+            if ( auto error = input.Error() )
+                state->promise.SetException(error);
+            else if constexpr ( std::is_void_v<T> )
+                state->promise.SetValue(i);
+            else
+                state->promise.SetValue(i, input.Take());
+        });
+    }
+    return result;
+}
+
+} // namespace threadpool
+} // namespace server
+
+#endif // !FUTURE_H
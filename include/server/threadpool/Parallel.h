@@ -0,0 +1,307 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "Task.h"
+#include "ThreadPool.h"
+
+namespace server {
+namespace threadpool {
+
+namespace detail {
+
+// Shared bookkeeping of one parallel loop over [0, n). Chunks are handed out
+// guided-style: large at first, shrinking towards `grain` as the range
+// drains, so stragglers get small pieces and the tail stays balanced.
+class ParallelLoop
+{
+public:
+    typedef void (*Runner)(void * worker, ParallelLoop & loop);
+
+    ParallelLoop(std::size_t n, std::size_t grain, std::size_t participants, void * worker, Runner runner)
+        : _n(n)
+          , _grain(grain)
+          , _participants(participants)
+          , _next(0)
+          , _done(0)
+          , _failed(false)
+          , _error()
+          , _worker(worker)
+          , _runner(runner)
+          , _mx()
+          , _cv()
+    {}
+
+    bool Claim(std::size_t & lo, std::size_t & hi)
+    {
+        if ( _failed.load(std::memory_order_relaxed) )
+            return false;
+        auto cur = _next.load(std::memory_order_relaxed);
+        while ( cur < _n ) {
+            auto chunk = std::max(_grain, ( _n - cur ) / ( 2 * _participants ));
+            auto end = std::min(_n, cur + chunk);
+            if ( _next.compare_exchange_weak(cur, end, std::memory_order_relaxed) ) {
+                lo = cur;
+                hi = end;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void Complete(std::size_t count)
+    {
+        if ( count > 0 && _done.fetch_add(count, std::memory_order_acq_rel) + count == _n ) {
+            std::lock_guard<std::mutex> lk(_mx);
+            _cv.notify_all();
+        }
+    }
+
+    void Fail(std::exception_ptr error)
+    {
+        {
+            std::lock_guard<std::mutex> lk(_mx);
+            if ( !_error )
+                _error = error;
+        }
+        _failed = true;
+        auto old = _next.exchange(_n);
+        if ( old < _n )
+            Complete(_n - old);
+    }
+
+    void Wait()
+    {
+        std::unique_lock<std::mutex> lk(_mx);
+        _cv.wait(lk, [this] { return _done.load(std::memory_order_acquire) == _n; });
+        if ( _error )
+            std::rethrow_exception(_error);
+    }
+
+    void Run() { _runner(_worker, *this); }
+
+private:
+    std::size_t const _n;
+    std::size_t const _grain;
+    std::size_t const _participants;
+    std::atomic<std::size_t> _next;
+    std::atomic<std::size_t> _done;
+    std::atomic_bool _failed;
+    std::exception_ptr _error;
+    void * const _worker;
+    Runner const _runner;
+    std::mutex _mx;
+    std::condition_variable _cv;
+};
+
+// What a participant sees: the chunk it already owns first, then whatever
+// it can still claim. A chunk counts as done once the next one is requested
+// or the participant leaves, so per-participant results are published first.
+class ChunkSource
+{
+public:
+    ChunkSource(ParallelLoop & loop, std::size_t lo, std::size_t hi)
+        : _loop(loop)
+          , _lo(lo)
+          , _hi(hi)
+          , _primed(true)
+          , _owned(0)
+    {}
+
+    ChunkSource(ChunkSource const &) = delete;
+    ChunkSource & operator=(ChunkSource const &) = delete;
+    ~ChunkSource() { _loop.Complete(_owned); }
+
+    bool Next(std::size_t & lo, std::size_t & hi)
+    {
+        if ( _primed ) {
+            _primed = false;
+        } else {
+            std::size_t nextLo, nextHi;
+            if ( !_loop.Claim(nextLo, nextHi) )
+                return false;
+            _loop.Complete(_owned);
+            _lo = nextLo;
+            _hi = nextHi;
+        }
+        _owned = _hi - _lo;
+        lo = _lo;
+        hi = _hi;
+        return true;
+    }
+
+private:
+    ParallelLoop & _loop;
+    std::size_t _lo;
+    std::size_t _hi;
+    bool _primed;
+    std::size_t _owned;
+};
+
+template<typename Worker>
+void RunChunks(void * worker, ParallelLoop & loop)
+{
+    std::size_t lo, hi;
+    // Never touch the caller's worker without owning a chunk: a helper that
+    // starts after the loop drained must not reach into a finished frame.
+    if ( !loop.Claim(lo, hi) )
+        return;
+    ChunkSource source(loop, lo, hi);
+    try {
+        (*static_cast<Worker *>(worker))(source);
+    } catch ( ... ) {
+        loop.Fail(std::current_exception());
+    }
+}
+
+inline std::size_t AdaptiveGrain(std::size_t n, std::size_t participants)
+{
+    return std::max<std::size_t>(1, n / ( participants * 8 ));
+}
+
+// Runs worker(ChunkSource &) on the calling thread and on up to Size()
+// pool threads until [0, n) is covered, then returns (or rethrows).
+template<typename Worker>
+void ParallelChunks(ThreadPool & pool, std::size_t n, std::size_t grain, Worker & worker)
+{
+    if ( n == 0 )
+        return;
+    std::size_t participants = pool.Size() + 1;
+    if ( grain == 0 )
+        grain = AdaptiveGrain(n, participants);
+    std::size_t helpers = std::min(participants - 1, ( n + grain - 1 ) / grain - 1);
+
+    auto loop = std::make_shared<ParallelLoop>(n, grain, helpers + 1, &worker, &RunChunks<Worker>);
+    if ( helpers > 0 ) {
+        std::vector<Task> tasks;
+        tasks.reserve(helpers);
+        for ( std::size_t i = 0; i < helpers; ++i )
+            tasks.emplace_back([loop] { loop->Run(); });
+        pool.EnqueueBatch(tasks);
+    }
+    loop->Run();
+    loop->Wait();
+}
+
+} // namespace detail
+
+// fn(i) for every i in [begin, end). grain == 0 picks one from the range
+// size and the pool size.
+template<typename Index, typename Fn>
+void ParallelFor(ThreadPool & pool, Index begin, Index end, std::size_t grain, Fn && fn)
+{
+    if ( !( begin < end ) )
+        return;
+    auto worker = [&] (detail::ChunkSource & source) {
+        std::size_t lo, hi;
+        while ( source.Next(lo, hi) )
+            for ( auto i = lo; i < hi; ++i )
+                fn(static_cast<Index>(begin + i));
+    };
+    detail::ParallelChunks(pool, static_cast<std::size_t>(end - begin), grain, worker);
+}
+
+template<typename Index, typename Fn>
+void ParallelFor(Index begin, Index end, std::size_t grain, Fn && fn)
+{
+    ParallelFor(ThreadPool::GetGlobalThreadPool(), begin, end, grain, std::forward<Fn>(fn));
+}
+
+// Folds map(i) over [begin, end) with `reduce`, which must be associative
+// and commutative: partial results are combined in completion order.
+template<typename Index, typename T, typename MapFn, typename ReduceFn>
+T ParallelReduce(ThreadPool & pool, Index begin, Index end, std::size_t grain, T identity, MapFn && map, ReduceFn && reduce)
+{
+    if ( !( begin < end ) )
+        return identity;
+    T result = identity;
+    std::mutex mx;
+    auto worker = [&] (detail::ChunkSource & source) {
+        T local = identity;
+        std::size_t lo, hi;
+        while ( source.Next(lo, hi) )
+            for ( auto i = lo; i < hi; ++i )
+                local = reduce(std::move(local), map(static_cast<Index>(begin + i)));
+        std::lock_guard<std::mutex> lk(mx);
+        result = reduce(std::move(result), std::move(local));
+    };
+    detail::ParallelChunks(pool, static_cast<std::size_t>(end - begin), grain, worker);
+    return result;
+}
+
+template<typename Index, typename T, typename MapFn, typename ReduceFn>
+T ParallelReduce(Index begin, Index end, std::size_t grain, T identity, MapFn && map, ReduceFn && reduce)
+{
+    return ParallelReduce(ThreadPool::GetGlobalThreadPool(), begin, end, grain, std::move(identity), std::forward<MapFn>(map), std::forward<ReduceFn>(reduce));
+}
+
+// out[i] = fn(first[i]); both iterators must be random access.
+template<typename InputIt, typename OutputIt, typename Fn>
+OutputIt ParallelTransform(ThreadPool & pool, InputIt first, InputIt last, OutputIt out, Fn && fn, std::size_t grain = 0)
+{
+    auto n = std::distance(first, last);
+    ParallelFor(pool, decltype(n)(0), n, grain, [&] (auto i) { out[i] = fn(first[i]); });
+    return out + n;
+}
+
+template<typename InputIt, typename OutputIt, typename Fn>
+OutputIt ParallelTransform(InputIt first, InputIt last, OutputIt out, Fn && fn, std::size_t grain = 0)
+{
+    return ParallelTransform(ThreadPool::GetGlobalThreadPool(), first, last, out, std::forward<Fn>(fn), grain);
+}
+
+// Sorts runs in parallel, then merges neighbouring runs pairwise in
+// parallel rounds. Not stable.
+template<typename RandomIt, typename Compare = std::less<>>
+void ParallelSort(ThreadPool & pool, RandomIt first, RandomIt last, Compare comp = Compare(), std::size_t grain = 0)
+{
+    constexpr static std::size_t SEQUENTIAL_CUTOFF = 4096;
+    std::size_t n = std::distance(first, last);
+    std::size_t runs = pool.Size() + 1;
+    if ( grain == 0 )
+        grain = std::max(SEQUENTIAL_CUTOFF, ( n + runs - 1 ) / runs);
+    if ( n <= grain || runs < 2 ) {
+        std::sort(first, last, comp);
+        return;
+    }
+    runs = ( n + grain - 1 ) / grain;
+
+    std::vector<std::size_t> bounds(runs + 1);
+    for ( std::size_t i = 0; i <= runs; ++i )
+        bounds[i] = std::min(n, i * grain);
+
+    ParallelFor(pool, std::size_t(0), runs, 1, [&] (std::size_t i) {
+        std::sort(first + bounds[i], first + bounds[i + 1], comp);
+    });
+
+    for ( std::size_t width = 1; width < runs; width *= 2 ) {
+        std::size_t merges = ( runs + 2 * width - 1 ) / ( 2 * width );
+        ParallelFor(pool, std::size_t(0), merges, 1, [&] (std::size_t m) {
+            auto lo = bounds[m * 2 * width];
+            auto mid = bounds[std::min(runs, m * 2 * width + width)];
+            auto hi = bounds[std::min(runs, m * 2 * width + 2 * width)];
+            if ( mid < hi )
+                std::inplace_merge(first + lo, first + mid, first + hi, comp);
+        });
+    }
+}
+
+template<typename RandomIt, typename Compare = std::less<>>
+void ParallelSort(RandomIt first, RandomIt last, Compare comp = Compare(), std::size_t grain = 0)
+{
+    ParallelSort(ThreadPool::GetGlobalThreadPool(), first, last, comp, grain);
+}
+
+} // namespace threadpool
+} // namespace server
+
+#endif // !PARALLEL_H
@@ -0,0 +1,137 @@
+#ifndef TASK_H
+#define TASK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace server {
+namespace threadpool {
+
+// Move-only type-erased `void()` callable. Callables up to INLINE_SIZE bytes
+// that are nothrow movable live inside the object, so queueing one costs no
+// heap allocation; larger ones fall back to a single `new`.
+class Task
+{
+public:
+    constexpr static std::size_t INLINE_SIZE = 48;
+
+public:
+    Task() noexcept
+        : _vtable(nullptr)
+          , _stamp(0)
+    {}
+
+    template<typename Fn,
+        typename F = std::decay_t<Fn>,
+        typename = std::enable_if_t<!std::is_same_v<F, Task> && std::is_invocable_v<F &>>>
+    Task(Fn && fn)
+        : _vtable(&VTableFor<F>::table)
+          , _stamp(0)
+    {
+        if constexpr ( IsInline<F>() )
+            ::new (static_cast<void *>(&_storage)) F(std::forward<Fn>(fn));
+        else
+            ::new (static_cast<void *>(&_storage)) F *(new F(std::forward<Fn>(fn)));
+    }
+
+    Task(Task && other) noexcept
+        : _vtable(other._vtable)
+          , _stamp(other._stamp)
+    {
+        if ( _vtable ) {
+            _vtable->move(&_storage, &other._storage);
+            other._vtable = nullptr;
+        }
+    }
+
+    Task & operator=(Task && other) noexcept
+    {
+        if ( this != &other ) {
+            Reset();
+            _vtable = other._vtable;
+            _stamp = other._stamp;
+            if ( _vtable ) {
+                _vtable->move(&_storage, &other._storage);
+                other._vtable = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    Task(Task const &) = delete;
+    Task & operator=(Task const &) = delete;
+
+    ~Task() { Reset(); }
+
+    void operator()() { _vtable->invoke(&_storage); }
+
+    explicit operator bool() const noexcept { return _vtable != nullptr; }
+
+    // Monotonic nanoseconds at which the task was queued, 0 if never set.
+    // Occupies what would otherwise be tail padding.
+    uint64_t EnqueueTime() const noexcept { return _stamp; }
+    void SetEnqueueTime(uint64_t ns) noexcept { _stamp = ns; }
+
+    void Reset() noexcept
+    {
+        if ( _vtable ) {
+            _vtable->destroy(&_storage);
+            _vtable = nullptr;
+        }
+    }
+
+private:
+    typedef std::aligned_storage_t<INLINE_SIZE, alignof(std::max_align_t)> Storage;
+
+    struct VTable
+    {
+        void (*invoke)(void *);
+        void (*move)(void * dst, void * src);
+        void (*destroy)(void *);
+    };
+
+    template<typename F>
+    constexpr static bool IsInline()
+    {
+        return sizeof(F) <= INLINE_SIZE
+            && alignof(F) <= alignof(std::max_align_t)
+            && std::is_nothrow_move_constructible_v<F>;
+    }
+
+    template<typename F, bool = IsInline<F>()>
+    struct VTableFor
+    {
+        static void Invoke(void * p) { (*static_cast<F *>(p))(); }
+        static void Move(void * dst, void * src)
+        {
+            ::new (dst) F(std::move(*static_cast<F *>(src)));
+            static_cast<F *>(src)->~F();
+        }
+        static void Destroy(void * p) { static_cast<F *>(p)->~F(); }
+
+        constexpr static VTable table = { &Invoke, &Move, &Destroy };
+    };
+
+    template<typename F>
+    struct VTableFor<F, false>
+    {
+        static void Invoke(void * p) { (**static_cast<F **>(p))(); }
+        static void Move(void * dst, void * src) { ::new (dst) F *(*static_cast<F **>(src)); }
+        static void Destroy(void * p) { delete *static_cast<F **>(p); }
+
+        constexpr static VTable table = { &Invoke, &Move, &Destroy };
+    };
+
+private:
+    Storage _storage;
+    VTable const * _vtable;
+    uint64_t _stamp;
+};
+
+} // namespace threadpool
+} // namespace server
+
+#endif // !TASK_H
@@ -0,0 +1,297 @@
+#ifndef TASKGRAPH_H
+#define TASKGRAPH_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include "Future.h"
+#include "Task.h"
+#include "ThreadPool.h"
+
+namespace server {
+namespace threadpool {
+
+// A DAG of callables run on a ThreadPool. Every node waits for its
+// predecessors through an atomic counter; the worker finishing the last
+// predecessor picks the node up itself (or queues it when several become
+// ready at once), so no worker ever blocks on another node.
+//
+// The structure is built once and can be Run() any number of times, and
+// runs may overlap; each has its own counters and timings. Editing the
+// graph while a run is in flight is safe, the run keeps the structure it
+// started with. The TaskGraph object itself is not synchronized.
+class TaskGraph
+{
+public:
+    typedef std::size_t Node;
+
+    // Per-run timings, all in nanoseconds.
+    struct Profile
+    {
+        uint64_t wall;                 // Run() to last node finished
+        uint64_t criticalPath;         // longest dependency chain by node run time
+        std::vector<Node> path;        // that chain, first node first
+        std::vector<uint64_t> nodes;   // run time of every node
+    };
+
+public:
+    TaskGraph()
+        : _graph(std::make_shared<Graph>())
+    {}
+
+    TaskGraph(TaskGraph &&) = default;
+    TaskGraph & operator=(TaskGraph &&) = default;
+    TaskGraph(TaskGraph const &) = delete;
+    TaskGraph & operator=(TaskGraph const &) = delete;
+    ~TaskGraph() = default;
+
+    Node Emplace(std::function<void()> fn, std::string name = {})
+    {
+        auto & graph = Mutable();
+        graph.nodes.push_back({ std::move(fn), std::move(name), {}, 0 });
+        return graph.nodes.size() - 1;
+    }
+
+    // `after` runs once `before` has finished.
+    void Precede(Node before, Node after)
+    {
+        auto & graph = Mutable();
+        if ( before >= graph.nodes.size() || after >= graph.nodes.size() || before == after )
+            throw std::out_of_range("TaskGraph::Precede: invalid node");
+        graph.nodes[before].successors.push_back(after);
+        ++graph.nodes[after].predecessors;
+    }
+
+    void Precede(Node before, std::initializer_list<Node> after)
+    {
+        for ( auto node : after )
+            Precede(before, node);
+    }
+
+    void Succeed(Node after, std::initializer_list<Node> before)
+    {
+        for ( auto node : before )
+            Precede(node, after);
+    }
+
+    std::size_t Size() const { return _graph->nodes.size(); }
+
+    std::string const & Name(Node node) const { return _graph->nodes.at(node).name; }
+
+    // Starts a run and returns at once. Nodes run with `priority`; the
+    // future completes with the run's profile, or with the first exception
+    // a node threw (the nodes depending on it are then skipped). Throws
+    // std::logic_error if the graph has a cycle.
+    Future<Profile> Run(ThreadPool & pool, Priority priority = Priority::NORMAL)
+    {
+        auto graph = Sealed();
+        auto run = std::make_shared<RunState>(std::move(graph), pool, priority);
+        auto result = run->promise.GetFuture();
+        if ( run->graph->nodes.empty() ) {
+            run->Finish();
+            return result;
+        }
+        std::vector<Node> ready;
+        for ( Node i = 0; i < run->graph->nodes.size(); ++i )
+            if ( run->graph->nodes[i].predecessors == 0 )
+                ready.push_back(i);
+        Submit(run, ready.begin(), ready.end());
+        return result;
+    }
+
+    Future<Profile> Run(Priority priority = Priority::NORMAL)
+    {
+        return Run(ThreadPool::GetGlobalThreadPool(), priority);
+    }
+
+private:
+    struct NodeData
+    {
+        std::function<void()> fn;
+        std::string name;
+        std::vector<Node> successors;
+        uint32_t predecessors;
+    };
+
+    struct Graph
+    {
+        std::vector<NodeData> nodes;
+        std::vector<Node> order; // topological, filled by Sealed()
+    };
+
+    struct RunState
+    {
+        RunState(std::shared_ptr<Graph const> g, ThreadPool & p, Priority pr)
+            : graph(std::move(g))
+              , pool(p)
+              , priority(pr)
+              , pending(new std::atomic<uint32_t>[graph->nodes.size()])
+              , remaining(graph->nodes.size())
+              , begin(Now())
+              , start(graph->nodes.size(), 0)
+              , end(graph->nodes.size(), 0)
+              , failed(false)
+              , mx()
+              , error()
+              , promise(&p, pr)
+        {
+            for ( std::size_t i = 0; i < graph->nodes.size(); ++i )
+                pending[i].store(graph->nodes[i].predecessors, std::memory_order_relaxed);
+        }
+
+        // Called once, by whoever finished the last node; the acq_rel
+        // countdown of `remaining` makes every node's timings visible here.
+        void Finish()
+        {
+            if ( error ) {
+                promise.SetException(error);
+                return;
+            }
+            auto & nodes = graph->nodes;
+            Profile profile = { Now() - begin, 0, {}, std::vector<uint64_t>(nodes.size()) };
+            std::vector<uint64_t> longest(nodes.size(), 0);
+            std::vector<Node> via(nodes.size(), nodes.size());
+            Node last = nodes.size();
+            for ( auto node : graph->order ) {
+                profile.nodes[node] = end[node] - start[node];
+                longest[node] += profile.nodes[node];
+                for ( auto next : nodes[node].successors ) {
+                    if ( longest[node] > longest[next] || via[next] == nodes.size() ) {
+                        longest[next] = longest[node];
+                        via[next] = node;
+                    }
+                }
+                if ( last == nodes.size() || longest[node] > longest[last] )
+                    last = node;
+            }
+            if ( last != nodes.size() ) {
+                profile.criticalPath = longest[last];
+                for ( auto node = last; node != nodes.size(); node = via[node] )
+                    profile.path.push_back(node);
+                std::reverse(profile.path.begin(), profile.path.end());
+            }
+            promise.SetValue(std::move(profile));
+        }
+
+        std::shared_ptr<Graph const> graph;
+        ThreadPool & pool;
+        Priority priority;
+        std::unique_ptr<std::atomic<uint32_t>[]> pending;
+        std::atomic<std::size_t> remaining;
+        uint64_t begin;
+        std::vector<uint64_t> start;
+        std::vector<uint64_t> end;
+        std::atomic_bool failed;
+        std::mutex mx;
+        std::exception_ptr error;
+        Promise<Profile> promise;
+    };
+
+private:
+    static uint64_t Now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    Graph & Mutable()
+    {
+        // Runs in flight hold the old structure; copy instead of editing it.
+        if ( _graph.use_count() > 1 )
+            _graph = std::make_shared<Graph>(*_graph);
+        _graph->order.clear();
+        return *_graph;
+    }
+
+    std::shared_ptr<Graph const> Sealed()
+    {
+        auto & nodes = _graph->nodes;
+        if ( _graph->order.size() == nodes.size() )
+            return _graph;
+        std::vector<uint32_t> indegree(nodes.size());
+        for ( std::size_t i = 0; i < nodes.size(); ++i )
+            indegree[i] = nodes[i].predecessors;
+        std::vector<Node> order;
+        order.reserve(nodes.size());
+        for ( Node i = 0; i < nodes.size(); ++i )
+            if ( indegree[i] == 0 )
+                order.push_back(i);
+        for ( std::size_t i = 0; i < order.size(); ++i )
+            for ( auto next : nodes[order[i]].successors )
+                if ( --indegree[next] == 0 )
+                    order.push_back(next);
+        if ( order.size() != nodes.size() )
+            throw std::logic_error("TaskGraph::Run: graph has a cycle");
+        _graph->order = std::move(order);
+        return _graph;
+    }
+
+    template<typename It>
+    static void Submit(std::shared_ptr<RunState> const & run, It first, It last)
+    {
+        std::vector<Task> tasks;
+        tasks.reserve(std::distance(first, last));
+        for ( ; first != last; ++first )
+            tasks.emplace_back([run, node = *first] { Execute(run, node); });
+        run->pool.EnqueueBatch(tasks, run->priority);
+        for ( auto & task : tasks )
+            if ( task )
+                task();
+    }
+
+    // Runs `node`, then keeps going with one newly ready successor on this
+    // worker and queues the others.
+    static void Execute(std::shared_ptr<RunState> const & run, Node node)
+    {
+        std::vector<Node> ready;
+        while ( true ) {
+            auto & data = run->graph->nodes[node];
+            run->start[node] = Now();
+            if ( !run->failed.load(std::memory_order_relaxed) ) {
+                try {
+                    if ( data.fn )
+                        data.fn();
+                } catch ( ... ) {
+                    std::lock_guard<std::mutex> lk(run->mx);
+                    if ( !run->error )
+                        run->error = std::current_exception();
+                    run->failed = true;
+                }
+            }
+            run->end[node] = Now();
+
+            ready.clear();
+            for ( auto next : data.successors )
+                if ( run->pending[next].fetch_sub(1, std::memory_order_acq_rel) == 1 )
+                    ready.push_back(next);
+            if ( ready.size() > 1 )
+                Submit(run, ready.begin() + 1, ready.end());
+
+            if ( run->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1 ) {
+                run->Finish();
+                return;
+            }
+            if ( ready.empty() )
+                return;
+            node = ready.front();
+        }
+    }
+
+private:
+    std::shared_ptr<Graph> _graph;
+};
+
+} // namespace threadpool
+} // namespace server
+
+#endif // !TASKGRAPH_H
@@ -1,68 +1,160 @@
 #ifndef THREADPOOL_H
 #define THREADPOOL_H
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
 #include <cstddef>
 #include <cstdint>
 #include <functional>
 #include <future>
+#include <iterator>
 #include <memory>
 #include <mutex>
 #include <queue>
+#include <random>
+#include <chrono>
 #include <thread>
-#include <fstream>
-#include <sstream>
+#include <tuple>
 #include <string>
 #include <type_traits>
 #include <unordered_map>
 #include <utility>
 #include <vector>
+#include "Affinity.h"
+#include "BoundedQueue.h"
+#include "Task.h"
 #include "Timer.h"
+#include "WorkStealingQueue.h"
 
 namespace server {
 namespace threadpool {
 
+// What a bounded queue does with a task that does not fit.
+enum class FullPolicy : uint8_t {
+    BLOCK,          // wait for a free slot
+    REJECT,         // refuse it, Post() returns false and the future is broken
+    CALLER_RUNS,    // run it on the submitting thread
+    DISCARD_OLDEST, // drop the oldest queued task to make room
+};
+
+// Lanes are served in this order. I/O completions belong in HIGH, batch and
+// business logic in LOW; EnqueueTask/Post without a priority use NORMAL.
+enum class Priority : uint8_t {
+    HIGH = 0,
+    NORMAL = 1,
+    LOW = 2,
+};
+
+constexpr static std::size_t PRIORITY_LANES = 3;
+
 struct ThreadPoolConfig
 {
     uint32_t min_core_thread;
     uint32_t max_thread;
-    bool start_monitor_timer;
-    uint32_t monitor_period; // microsecond
-    uint8_t verify_count;
+    bool start_monitor_timer; // autoscale between min_core_thread and max_thread
+    uint32_t monitor_period; // millisecond
+    uint8_t verify_count; // consecutive backlogged periods before growing
+    bool work_stealing;
+    bool bounded_queue;
+    uint32_t queue_capacity;
+    FullPolicy full_policy;
+    uint32_t starvation_limit; // every Nth pick scans lanes lowest first, 0 disables
+    std::vector<int> cpu_set; // CPUs workers may run on, empty means all
+    Placement placement;
+    std::string thread_name; // workers are named "<thread_name>-<slot>"
+    uint32_t scale_up_wait; // microsecond, average queue wait that counts as backlog
+    uint32_t scale_down_idle; // millisecond a surplus worker must stay underused before it retires
+    uint8_t scale_down_busy; // percent, busy ratio below which the pool counts as underused
+    uint32_t spin_count; // idle polls with a pause instruction before yielding
+    uint32_t yield_count; // idle polls with sched_yield before parking
 };
 
 inline static ThreadPoolConfig GlobalThreadPoolConfig = {
     1,
     std::thread::hardware_concurrency(),
     false,
-    30000,
-    3,
+    10,
+    2,
+    false,
+    false,
+    65536,
+    FullPolicy::BLOCK,
+    16,
+    {},
+    Placement::NONE,
+    "pool",
+    1000,
+    1000,
+    30,
+    std::thread::hardware_concurrency() > 1 ? 256u : 0u,
+    8,
 };
 
 class ThreadPool {
-    enum ThredShold {
-        FIRST = 50,
-        SECOND = 70,
-        THIRD = 90,
-    };
-
     enum Stat : uint8_t {
         EMPTY = 0,
         ACTIVE = 1,
         DEAD = 2,
     };
 
+    typedef Task TaskType;
+
+    struct Worker
+    {
+        Worker() : thread(), stat(DEAD), local(), picks(0), executed(0), waitNs(0), busyNs(0) {}
+
+        std::thread thread;
+        std::atomic<Stat> stat;
+        WorkStealingQueue<TaskType> local;
+        uint32_t picks;
+        // Written only by the owning worker, sampled by the monitor.
+        alignas(64) std::atomic<uint64_t> executed;
+        std::atomic<uint64_t> waitNs;
+        std::atomic<uint64_t> busyNs;
+    };
+
+    // Totals of the per-worker counters at the previous monitor tick.
+    struct Sample
+    {
+        uint64_t executed;
+        uint64_t waitNs;
+        uint64_t busyNs;
+        uint64_t at;
+    };
+
+    struct Lane
+    {
+        Lane() : tasks(), ring(), depth(0) {}
+
+        std::queue<TaskType> tasks; // guarded by _queueMutex
+        std::unique_ptr<BoundedQueue<TaskType>> ring;
+        std::atomic<std::size_t> depth; // size of `tasks`, changed under _queueMutex
+    };
+
 public:
     ThreadPool()
         : _workers()
-          , _workerStat()
-          , _tasks()
+          , _liveWorkers(0)
+          , _lanes()
           , _queueMutex()
           , _cv()
+          , _notFull()
+          , _localPending(0)
+          , _sleepers(0)
+          , _blockedProducers(0)
+          , _rejected(0)
+          , _dropped(0)
+          , _callerRuns(0)
           , _config(GlobalThreadPoolConfig)
+          , _cpuOrder()
           , _timer()
-          , _prevIdleTime(0)
-          , _prevTotalTime(0)
-          , _thredShold(FIRST)
+          , _monitor()
+          , _measure(false)
+          , _lastSample()
+          , _backlogTicks(0)
+          , _idleSince(0)
           , _stop(false)
     {
         Init();
@@ -70,14 +162,25 @@ public:
 
     ThreadPool(ThreadPoolConfig config)
           : _workers()
-          , _tasks()
+          , _liveWorkers(0)
+          , _lanes()
           , _queueMutex()
           , _cv()
-          , _config(config)
+          , _notFull()
+          , _localPending(0)
+          , _sleepers(0)
+          , _blockedProducers(0)
+          , _rejected(0)
+          , _dropped(0)
+          , _callerRuns(0)
+          , _config(std::move(config))
+          , _cpuOrder()
           , _timer()
-          , _prevIdleTime(0)
-          , _prevTotalTime(0)
-          , _thredShold(FIRST)
+          , _monitor()
+          , _measure(false)
+          , _lastSample()
+          , _backlogTicks(0)
+          , _idleSince(0)
           , _stop(false)
     {
         Init();
@@ -116,181 +219,627 @@ public:
     //     _cv.notify_one();
     // }
 
+    // With a bounded queue and FullPolicy::REJECT the returned future may
+    // hold std::future_error(broken_promise) instead of a value.
     template<typename Fn,
         typename... Args,
         typename R = std::invoke_result_t<std::decay_t<Fn>, std::decay_t<Args>...>>
         // typename = std::enable_if_t<!std::is_void_v<R>>>
     std::future<R> EnqueueTask(Fn && fn, Args &&... args)
     {
-        auto func = std::bind(std::forward<Fn>(fn), std::forward<Args>(args)...);
-        auto task = std::make_shared<std::packaged_task<R()>>(std::move(func));
-        std::future<R> result = task->get_future();
+        return EnqueueTask(Priority::NORMAL, std::forward<Fn>(fn), std::forward<Args>(args)...);
+    }
+
+    template<typename Fn,
+        typename... Args,
+        typename R = std::invoke_result_t<std::decay_t<Fn>, std::decay_t<Args>...>>
+    std::future<R> EnqueueTask(Priority priority, Fn && fn, Args &&... args)
+    {
+        std::packaged_task<R()> task(Bind(std::forward<Fn>(fn), std::forward<Args>(args)...));
+        std::future<R> result = task.get_future();
+        Schedule(std::move(task), priority);
+        return result;
+    }
+
+    // Fire-and-forget submission: no future, no shared state, and for small
+    // callables no allocation at all. Returns false if the task was rejected.
+    template<typename Fn,
+        typename... Args,
+        typename = std::enable_if_t<!std::is_same_v<std::decay_t<Fn>, Priority>>>
+    bool Post(Fn && fn, Args &&... args)
+    {
+        return Schedule(Bind(std::forward<Fn>(fn), std::forward<Args>(args)...), Priority::NORMAL);
+    }
+
+    template<typename Fn, typename... Args>
+    bool Post(Priority priority, Fn && fn, Args &&... args)
+    {
+        return Schedule(Bind(std::forward<Fn>(fn), std::forward<Args>(args)...), priority);
+    }
+
+    template<typename Fn, typename... Args>
+    bool Execute(Fn && fn, Args &&... args)
+    {
+        return Post(std::forward<Fn>(fn), std::forward<Args>(args)...);
+    }
+
+    // Awaitable moving a coroutine onto a worker: `co_await pool.Schedule()`.
+    // Header stays C++17, await_suspend takes any coroutine handle. If the
+    // pool refuses the resumption the coroutine simply keeps running inline.
+    class ScheduleAwaiter
+    {
+    public:
+        ScheduleAwaiter(ThreadPool & pool, Priority priority)
+            : _pool(pool)
+              , _priority(priority)
+        {}
+
+        bool await_ready() const noexcept { return false; }
+
+        template<typename Handle>
+        bool await_suspend(Handle handle) { return _pool.Post(_priority, [handle] () mutable { handle.resume(); }); }
+
+        void await_resume() const noexcept {}
+
+    private:
+        ThreadPool & _pool;
+        Priority _priority;
+    };
+
+    ScheduleAwaiter Schedule(Priority priority = Priority::NORMAL) { return ScheduleAwaiter(*this, priority); }
+
+    // Submits a range of Tasks with one lock acquisition (or one CAS in
+    // bounded mode) and wakes at most as many workers as tasks were added.
+    // Accepted tasks are moved from; tasks refused by FullPolicy::REJECT are
+    // left untouched so the caller can run or drop them. Returns the number
+    // of accepted tasks.
+    template<typename It>
+    std::size_t EnqueueBatch(It first, It last, Priority priority = Priority::NORMAL)
+    {
+        std::size_t n = std::distance(first, last);
+        if ( n == 0 || _stop )
+            return 0;
+        if ( _measure ) {
+            auto now = Now();
+            for ( auto it = first; it != last; ++it )
+                it->SetEnqueueTime(now);
+        }
+        // What does not fit on the worker's own deque goes to the lanes.
+        std::size_t local = 0;
+        if ( priority == Priority::NORMAL && _config.work_stealing && _currentPool == this ) {
+            _localPending += n;
+            local = _workers[_currentIndex]->local.PushBatch(first, last);
+            _localPending -= n - local;
+            WakeSleepers(local);
+            if ( local == n )
+                return n;
+            std::advance(first, local);
+            n -= local;
+        }
+        auto & lane = _lanes[LaneOf(priority)];
+        if ( lane.ring ) {
+            std::size_t pushed = lane.ring->TryPushBatch(first, n);
+            std::advance(first, pushed);
+            WakeSleepers(pushed);
+            for ( ; first != last; ++first, ++pushed ) {
+                if ( !ScheduleBounded(*first, lane) )
+                    return local + pushed;
+            }
+            return local + pushed;
+        }
         {
             std::lock_guard<std::mutex> lock(_queueMutex);
-            _tasks.push([task] () { (*task)(); });
+            for ( auto it = first; it != last; ++it )
+                lane.tasks.push(std::move(*it));
+            lane.depth += n;
         }
-        _cv.notify_one();
-        return result;
+        NotifyWorkers(n);
+        return local + n;
     }
 
+    std::size_t EnqueueBatch(std::vector<TaskType> & tasks, Priority priority = Priority::NORMAL)
+    {
+        return EnqueueBatch(tasks.begin(), tasks.end(), priority);
+    }
+
+    // Number of threads currently serving tasks.
+    std::size_t Size() const { return _liveWorkers.load(std::memory_order_relaxed); }
+
+    bool WorkStealing() const { return _config.work_stealing; }
+
+    // CPU the worker in `slot` is pinned to, -1 without per-worker placement.
+    int WorkerCpu(std::size_t slot) const
+    {
+        if ( _cpuOrder.empty() )
+            return -1;
+        return _cpuOrder[slot % _cpuOrder.size()];
+    }
+
+    bool Bounded() const { return _lanes[0].ring != nullptr; }
+
+    // Tasks waiting in the global lanes and, in work-stealing mode, in the
+    // worker deques.
+    std::size_t QueueDepth() const
+    {
+        std::size_t depth = _localPending.load(std::memory_order_relaxed);
+        for ( std::size_t i = 0; i < PRIORITY_LANES; ++i )
+            depth += LaneDepth(i);
+        return depth;
+    }
+
+    // Tasks waiting in one global lane; NORMAL work sitting in worker deques
+    // is not included.
+    std::size_t LaneDepth(Priority priority) const { return LaneDepth(LaneOf(priority)); }
+
+    // Capacity of each bounded lane, 0 when unbounded.
+    std::size_t QueueCapacity() const { return Bounded() ? _lanes[0].ring->Capacity() : 0; }
+
+    // True when a bounded lane has no free slot left.
+    bool Saturated(Priority priority = Priority::NORMAL) const
+    {
+        auto & ring = _lanes[LaneOf(priority)].ring;
+        return ring && ring->Size() >= ring->Capacity();
+    }
+
+    uint64_t RejectedCount() const { return _rejected.load(std::memory_order_relaxed); }
+    uint64_t DroppedCount() const { return _dropped.load(std::memory_order_relaxed); }
+    uint64_t CallerRunsCount() const { return _callerRuns.load(std::memory_order_relaxed); }
+
     void Shutdown()
     {
-        if ( _stop )
+        if ( _stop.exchange(true) )
             return;
-        _stop = true;
         {
             std::lock_guard<std::mutex> lk(_queueMutex);
             _timer.Stop();
-            _tasks = {};
-            for ( auto & pair : _workerStat )
-                pair.second = DEAD;
+            for ( auto & lane : _lanes ) {
+                lane.tasks = {};
+                lane.depth = 0;
+                TaskType dropped;
+                while ( lane.ring && lane.ring->TryPop(dropped) )
+                    dropped.Reset();
+            }
+            for ( auto & worker : _workers )
+                worker->stat = DEAD;
         }
         _cv.notify_all();
-        for ( auto & pair : _workers )
-            pair.second.join();
+        _notFull.notify_all();
+        if ( _monitor.joinable() )
+            _monitor.join();
+        for ( auto & worker : _workers ) {
+            if ( worker->thread.joinable() )
+                worker->thread.join();
+            worker->local.Clear();
+        }
+        _liveWorkers = 0;
     }
 
 private:
     void Init()
     {
-        _workers.reserve(_config.max_thread);
-        _workerStat.reserve(_config.max_thread);
+        std::size_t slots = std::max(_config.min_core_thread, _config.max_thread);
+        _workers.reserve(slots);
+        for ( std::size_t i = 0; i < slots; ++i )
+            _workers.emplace_back(std::make_unique<Worker>());
+
+        if ( _config.placement != Placement::NONE )
+            _cpuOrder = CpuTopology::Get().Order(_config.placement, _config.cpu_set);
+
+        if ( _config.bounded_queue ) {
+            for ( auto & lane : _lanes )
+                lane.ring = std::make_unique<BoundedQueue<TaskType>>(_config.queue_capacity > 0 ? _config.queue_capacity : 65536);
+        }
+
+        _measure = _config.start_monitor_timer && _config.min_core_thread < _config.max_thread;
 
         for ( size_t i = 0; i < _config.min_core_thread; ++i )
+            SpawnWorker(i);
+
+        if ( _measure )
         {
-            std::thread t(&ThreadPool::WorkerThread, this);
-            auto id = t.get_id();
-            _workers.emplace(id, std::move(t));
-            _workerStat.emplace(id, ACTIVE);
+            _lastSample = { 0, 0, 0, Now() };
+            _timer.SetCallback(_config.monitor_period, [this] { Monitor(); });
+            _monitor = std::thread([this] {
+                SetCurrentThreadName(ThreadName("mon"));
+                _timer.Start();
+            });
         }
+    }
+
+    template<typename Fn, typename... Args>
+    static auto Bind(Fn && fn, Args &&... args)
+    {
+        if constexpr ( sizeof...(Args) == 0 && std::is_invocable_v<std::decay_t<Fn> &> )
+            return std::forward<Fn>(fn);
+        else
+            return [fn = std::forward<Fn>(fn), args = std::make_tuple(std::forward<Args>(args)...)] () mutable {
+                return std::apply(std::move(fn), std::move(args));
+            };
+    }
+
+    void SpawnWorker(std::size_t index)
+    {
+        auto & worker = *_workers[index];
+        worker.stat = ACTIVE;
+        worker.thread = std::thread(&ThreadPool::WorkerThread, this, index);
+        ++_liveWorkers;
+    }
+
+    std::string ThreadName(std::string const & suffix) const
+    {
+        return ( _config.thread_name.empty() ? "pool" : _config.thread_name ) + "-" + suffix;
+    }
+
+    static std::size_t LaneOf(Priority priority) { return static_cast<std::size_t>(priority); }
 
-        GetCPUStats(_prevIdleTime, _prevIdleTime);
+    std::size_t LaneDepth(std::size_t index) const
+    {
+        auto & lane = _lanes[index];
+        return lane.ring ? lane.ring->Size() : lane.depth.load(std::memory_order_relaxed);
+    }
+
+    static uint64_t Now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
 
-        if ( _config.start_monitor_timer && _config.min_core_thread < _config.max_thread )
+    bool Schedule(TaskType task, Priority priority)
+    {
+        if ( _measure )
+            task.SetEnqueueTime(Now());
+        // NORMAL tasks submitted from one of our own workers stay on its
+        // deque unless it is full; everything else goes through the global
+        // lanes.
+        if ( priority == Priority::NORMAL && _config.work_stealing && _currentPool == this ) {
+            ++_localPending;
+            if ( _workers[_currentIndex]->local.Push(task) ) {
+                WakeSleeper();
+                return true;
+            }
+            --_localPending;
+        }
+        auto & lane = _lanes[LaneOf(priority)];
+        if ( lane.ring )
+            return ScheduleBounded(task, lane);
         {
-            _timer.SetCallback(_config.monitor_period, [this] { Monitor(); });
-            std::thread t(&Timer::Start, &_timer);
-            _workers.emplace(t.get_id(), std::move(t));
+            std::lock_guard<std::mutex> lock(_queueMutex);
+            lane.tasks.push(std::move(task));
+            ++lane.depth;
         }
+        NotifyWorkers(1);
+        return true;
     }
 
-    void WorkerThread()
+    bool ScheduleBounded(TaskType & task, Lane & lane)
     {
-        std::thread::id id = std::this_thread::get_id();
-        auto it = _workerStat.find(id);
-        while ( it != _workerStat.end() && it->second == ACTIVE ) {
-            it->second = EMPTY;
-            std::function<void()> task;
-            {
+        auto & ring = lane.ring;
+        while ( !ring->TryPush(task) ) {
+            if ( _stop )
+                return false;
+            switch ( _config.full_policy ) {
+            case FullPolicy::REJECT:
+                ++_rejected;
+                return false;
+            case FullPolicy::CALLER_RUNS: {
+                ++_callerRuns;
+                TaskType run = std::move(task);
+                run();
+                return true;
+            }
+            case FullPolicy::DISCARD_OLDEST: {
+                TaskType oldest;
+                if ( ring->TryPop(oldest) )
+                    ++_dropped;
+                break;
+            }
+            case FullPolicy::BLOCK:
+                // A worker waiting for its own pool to drain could deadlock it.
+                if ( _currentPool == this ) {
+                    ++_callerRuns;
+                    TaskType run = std::move(task);
+                    run();
+                    return true;
+                }
                 std::unique_lock<std::mutex> lock(_queueMutex);
-                _cv.wait(lock, [this] { return _stop || !_tasks.empty(); });
-                if ( it->second == DEAD )
-                    break;
-                task = std::move(_tasks.front());
-                _tasks.pop();
-                it->second = ACTIVE;
+                ++_blockedProducers;
+                _notFull.wait(lock, [&] { return _stop || ring->Size() < ring->Capacity(); });
+                --_blockedProducers;
+                break;
             }
-            task();
         }
+        WakeSleeper();
+        return true;
     }
-    void GetCPUStats(long &idle_time, long &total_time) {
-        static std::ifstream file("/proc/stat");
-        std::string line;
-        std::getline(file, line);
-        file.close();
 
-        std::istringstream ss(line);
-        std::string cpu;
-        long user, nice, system, idle, iowait, irq, softirq, steal;
-        ss >> cpu >> user >> nice >> system >> idle >> iowait >> irq >> softirq >> steal;
+    // Producers that bypass _queueMutex only pay for a notify when somebody
+    // is actually waiting. The seq_cst fence pairs with the one a parking
+    // worker runs between ++_sleepers and its last HasWork(): with relaxed
+    // loads on both sides each could miss the other's write.
+    void WakeSleeper() { WakeSleepers(1); }
+
+    void WakeSleepers(std::size_t n)
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if ( n > 0 && _sleepers.load() > 0 ) {
+            { std::lock_guard<std::mutex> lock(_queueMutex); }
+            NotifyWorkers(n);
+        }
+    }
 
-        idle_time = idle + iowait;
-        total_time = user + nice + system + idle + iowait + irq + softirq + steal;
+    // Callers either hold _queueMutex while publishing or have passed it
+    // since, so a worker that saw no work is already counted in _sleepers.
+    void NotifyWorkers(std::size_t n)
+    {
+        auto sleepers = _sleepers.load();
+        if ( n >= sleepers ) {
+            if ( sleepers > 0 )
+                _cv.notify_all();
+            return;
+        }
+        for ( std::size_t i = 0; i < n; ++i )
+            _cv.notify_one();
     }
 
-    void GetThredShold(long const & d)
+    bool PopLane(Worker & self, std::size_t index, TaskType & task)
     {
-        if ( d < FIRST )
-            _thredShold = FIRST;
-        else if ( d < SECOND )
-            _thredShold = SECOND;
-        else
-            _thredShold = THIRD;
+        if ( index == LaneOf(Priority::NORMAL) && _config.work_stealing && self.local.Pop(task) ) {
+            --_localPending;
+            return true;
+        }
+        auto & lane = _lanes[index];
+        if ( lane.ring ) {
+            if ( !lane.ring->TryPop(task) )
+                return false;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if ( _blockedProducers.load() > 0 ) {
+                { std::lock_guard<std::mutex> lock(_queueMutex); }
+                _notFull.notify_all();
+            }
+            return true;
+        }
+        if ( lane.depth.load() == 0 )
+            return false;
+        std::lock_guard<std::mutex> lock(_queueMutex);
+        if ( lane.tasks.empty() )
+            return false;
+        task = std::move(lane.tasks.front());
+        lane.tasks.pop();
+        --lane.depth;
+        return true;
     }
 
-    void Monitor()
+    bool GlobalEmpty() const
     {
-        if (_config.min_core_thread < _config.max_thread )
-            return;
+        for ( std::size_t i = 0; i < PRIORITY_LANES; ++i )
+            if ( LaneDepth(i) > 0 )
+                return false;
+        return true;
+    }
 
-        long idle_time, total_time;
-        GetCPUStats(idle_time, total_time);
-        long idle_diff = idle_time - _prevIdleTime;
-        long total_diff = total_time - _prevTotalTime;
-        _prevIdleTime = idle_time;
-        _prevTotalTime = total_time;
-        double percent = (1.0 - (idle_diff * 1.0 / total_diff)) * 100.0;
-        GetThredShold(static_cast<long>(percent));
-        Adjust(percent);
-    }
-
-    void Adjust(double & d)
-    {
-        static uint8_t countForAdd = 0;
-        static uint8_t countForSub = 0;
-        if ( d < (1.0 * _thredShold) && !_tasks.empty() ) {
-            ++countForAdd;
-            if ( countForAdd > _config.verify_count
-                    && _workers.size() < _config.max_thread
-            ) {
-                std::thread t(&ThreadPool::WorkerThread, this);
-                auto id = t.get_id();
-                _workers.emplace(id, std::move(t));
-                _workerStat.emplace(id, ACTIVE);
-                countForAdd = 0;
+    void WorkerThread(std::size_t index)
+    {
+        _currentPool = this;
+        _currentIndex = index;
+        SetCurrentThreadName(ThreadName(std::to_string(index)));
+        if ( auto cpu = WorkerCpu(index); cpu >= 0 )
+            PinCurrentThread({ cpu });
+        else if ( !_config.cpu_set.empty() )
+            PinCurrentThread(_config.cpu_set);
+        auto & self = *_workers[index];
+        while ( true ) {
+            auto expected = ACTIVE;
+            if ( !self.stat.compare_exchange_strong(expected, EMPTY) && expected == DEAD )
+                break;
+            TaskType task;
+            if ( !NextTask(self, index, task) )
+                break;
+            // Retire() may retire us right after the pop, run what we took first.
+            expected = EMPTY;
+            bool retiring = !self.stat.compare_exchange_strong(expected, ACTIVE);
+            if ( _measure ) {
+                auto start = Now();
+                if ( task.EnqueueTime() != 0 && start > task.EnqueueTime() )
+                    self.waitNs.store(self.waitNs.load(std::memory_order_relaxed) + start - task.EnqueueTime(), std::memory_order_relaxed);
+                task();
+                self.busyNs.store(self.busyNs.load(std::memory_order_relaxed) + Now() - start, std::memory_order_relaxed);
+                self.executed.store(self.executed.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            } else {
+                task();
             }
-        } else if ( d < (1.0 * _thredShold) && _tasks.empty() ) {
-            ++countForSub;
-            if ( countForSub > _config.verify_count
-                    && _workers.size() > _config.min_core_thread
-            ) {
-                countForSub = 0;
-                std::vector<std::thread::id> vec;
-                {
-                    std::lock_guard<std::mutex> lk(_queueMutex);
-                    vec.reserve(_workers.size());
-                    for ( auto & pair : _workerStat )
-                    {
-                        auto & second = pair.second;
-                        if ( pair.second == EMPTY && _tasks.empty() )
-                        {
-                            pair.second = DEAD;
-                            vec.emplace_back(pair.first);
-                        }
-                    }
-                    _cv.notify_all();
-                }
-                for ( auto & id : vec) {
-                    _workers.erase(id);
-                    _workerStat.erase(id);
+            if ( retiring )
+                break;
+        }
+        _currentPool = nullptr;
+    }
+
+    bool NextTask(Worker & self, std::size_t index, TaskType & task)
+    {
+        while ( true ) {
+            // Lanes are served highest first, except that every
+            // starvation_limit-th pick scans them lowest first so a steady
+            // stream of I/O cannot starve batch work forever.
+            bool aging = _config.starvation_limit > 0 && self.picks + 1 >= _config.starvation_limit;
+            for ( std::size_t i = 0; i < PRIORITY_LANES; ++i ) {
+                if ( PopLane(self, aging ? PRIORITY_LANES - 1 - i : i, task) ) {
+                    self.picks = aging ? 0 : self.picks + 1;
+                    return true;
                 }
             }
+            if ( _config.work_stealing && _localPending.load() > 0 && Steal(index, task) ) {
+                --_localPending;
+                return true;
+            }
+            if ( Idle(self) )
+                continue;
+
+            std::unique_lock<std::mutex> lock(_queueMutex);
+            ++_sleepers;
+            // Pairs with the fence in WakeSleepers(): a producer that skips
+            // the mutex either sees this sleeper or its task is seen below.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            _cv.wait(lock, [&] { return _stop || self.stat == DEAD || HasWork(); });
+            --_sleepers;
+            if ( _stop || self.stat == DEAD )
+                return false;
         }
+    }
 
+    // Spin, then yield, before parking: a burst usually refills the queue
+    // within microseconds, and a worker that never parks costs producers no
+    // futex wake. Returns true once work shows up; stop and retirement end
+    // the wait early and are handled by the park path.
+    bool Idle(Worker & self)
+    {
+        for ( uint32_t i = 0; i < _config.spin_count + _config.yield_count; ++i ) {
+            if ( HasWork() )
+                return true;
+            if ( _stop || self.stat == DEAD )
+                return false;
+            if ( i < _config.spin_count )
+                CpuRelax();
+            else
+                std::this_thread::yield();
+        }
+        return false;
+    }
+
+    bool HasWork() const { return _localPending.load(std::memory_order_relaxed) > 0 || !GlobalEmpty(); }
+
+    static void CpuRelax()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        asm volatile("yield");
+#endif
+    }
+
+    bool Steal(std::size_t index, TaskType & task)
+    {
+        static thread_local std::minstd_rand random(std::random_device{}());
+        auto count = _workers.size();
+        auto start = random() % count;
+        for ( std::size_t i = 0; i < count; ++i ) {
+            auto victim = ( start + i ) % count;
+            if ( victim != index && _workers[victim]->local.Steal(task) )
+                return true;
+        }
+        return false;
+    }
+
+    // Runs every monitor_period on the monitor thread. Growth reacts to the
+    // pool's own backlog: queued work whose average wait in the last period
+    // exceeded scale_up_wait, or that saw no completion at all, for
+    // verify_count periods in a row. Shrinking needs the busy ratio to stay
+    // below scale_down_busy with empty queues for scale_down_idle.
+    void Monitor()
+    {
+        Sample sample = { 0, 0, 0, Now() };
+        for ( auto & worker : _workers ) {
+            sample.executed += worker->executed.load(std::memory_order_relaxed);
+            sample.waitNs += worker->waitNs.load(std::memory_order_relaxed);
+            sample.busyNs += worker->busyNs.load(std::memory_order_relaxed);
+        }
+        auto executed = sample.executed - _lastSample.executed;
+        auto waitNs = sample.waitNs - _lastSample.waitNs;
+        auto busyNs = sample.busyNs - _lastSample.busyNs;
+        auto elapsed = sample.at - _lastSample.at;
+        _lastSample = sample;
+
+        auto live = _liveWorkers.load();
+        auto depth = QueueDepth();
+        bool backlog = depth > 0 && ( executed == 0 || waitNs / executed >= _config.scale_up_wait * 1000ull );
+        double busy = ( elapsed > 0 && live > 0 ) ? busyNs * 1.0 / ( elapsed * live ) : 0.0;
+
+        if ( backlog ) {
+            _idleSince = 0;
+            if ( ++_backlogTicks >= std::max<uint8_t>(_config.verify_count, 1) && live < _config.max_thread ) {
+                _backlogTicks = 0;
+                Grow();
+            }
+            return;
+        }
+        _backlogTicks = 0;
+
+        if ( depth > 0 || busy * 100.0 >= _config.scale_down_busy || live <= _config.min_core_thread ) {
+            _idleSince = 0;
+            return;
+        }
+        if ( _idleSince == 0 )
+            _idleSince = sample.at;
+        if ( sample.at - _idleSince >= _config.scale_down_idle * 1000000ull ) {
+            _idleSince = sample.at;
+            Retire();
+        }
+    }
+
+    void Grow()
+    {
+        for ( std::size_t i = 0; i < _workers.size(); ++i )
+        {
+            auto & worker = *_workers[i];
+            if ( worker.stat != DEAD )
+                continue;
+            if ( worker.thread.joinable() )
+                worker.thread.join();
+            if ( _stop )
+                return;
+            SpawnWorker(i);
+            return;
+        }
+    }
+
+    // Retires one idle worker, highest slot first. A worker only becomes
+    // DEAD from EMPTY, so the join waits at most for the single task it may
+    // have picked up in the meantime.
+    void Retire()
+    {
+        Worker * victim = nullptr;
+        {
+            std::lock_guard<std::mutex> lk(_queueMutex);
+            for ( auto it = _workers.rbegin(); it != _workers.rend(); ++it )
+            {
+                auto expected = EMPTY;
+                if ( (*it)->stat.compare_exchange_strong(expected, DEAD) ) {
+                    victim = it->get();
+                    break;
+                }
+            }
+        }
+        if ( victim == nullptr )
+            return;
+        _cv.notify_all();
+        victim->thread.join();
+        --_liveWorkers;
     }
 
 private:
-    std::unordered_map<std::thread::id, std::thread> _workers;
-    std::unordered_map<std::thread::id, Stat> _workerStat;
-    std::queue<std::function<void()>> _tasks;
+    inline static thread_local ThreadPool * _currentPool = nullptr;
+    inline static thread_local std::size_t _currentIndex = 0;
+
+    std::vector<std::unique_ptr<Worker>> _workers;
+    std::atomic<std::size_t> _liveWorkers;
+    std::array<Lane, PRIORITY_LANES> _lanes;
     std::mutex _queueMutex;
     std::condition_variable _cv;
+    std::condition_variable _notFull;
+    // Counted before the push: a thief may take the task and decrement
+    // before the owner gets back, and this must never wrap below zero.
+    std::atomic<std::size_t> _localPending;
+    std::atomic<std::size_t> _sleepers;
+    std::atomic<std::size_t> _blockedProducers;
+    std::atomic<uint64_t> _rejected;
+    std::atomic<uint64_t> _dropped;
+    std::atomic<uint64_t> _callerRuns;
     ThreadPoolConfig _config;
+    std::vector<int> _cpuOrder;
     Timer _timer;
-    long _prevIdleTime;
-    long _prevTotalTime;
-    long _thredShold;
-    bool _stop;
+    std::thread _monitor;
+    bool _measure;
+    Sample _lastSample;
+    uint32_t _backlogTicks;
+    uint64_t _idleSince;
+    std::atomic_bool _stop;
 
 };
 
@@ -1,6 +1,7 @@
 #ifndef TIMER_H
 #define TIMER_H
 
+#include <atomic>
 #include <chrono>
 #include <functional>
 #include <thread>
@@ -32,16 +33,22 @@ public:
     Timer & operator=(Timer const &) = delete;
     ~Timer() { _stop = true; }
 
+    // Fires on a fixed grid from the first call, so time spent in the
+    // callback does not push later shots back. Blocks the calling thread;
+    // many timers belong in a TimingWheel instead.
     void Start()
     {
+        auto next = std::chrono::steady_clock::now();
         while ( !_stop )
         {
-            std::this_thread::sleep_for(std::chrono::milliseconds(_interval));
+            next += std::chrono::milliseconds(_interval);
+            std::this_thread::sleep_until(next);
+            if ( _stop )
+                break;
             if ( _cb )
                 _cb();
             ++_shotedCount;
         }
-
     }
 
     void Stop() { _stop = true; }
@@ -69,7 +76,7 @@ public:
 
 private:
     uint64_t _interval;
-    bool _stop;
+    std::atomic_bool _stop;
     uint64_t _shotedCount;
     std::function<void()> _cb;
 };
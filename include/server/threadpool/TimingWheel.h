@@ -0,0 +1,412 @@
+#ifndef TIMINGWHEEL_H
+#define TIMINGWHEEL_H
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "Affinity.h"
+#include "Task.h"
+#include "ThreadPool.h"
+
+namespace server {
+namespace threadpool {
+
+// Hierarchical timing wheel: a 256-slot root wheel of `tick` resolution and
+// three 64-slot wheels above it, each slot 64 times coarser than the one
+// below (with 1ms ticks: 256ms, 16s, 17min, 18h). Timers sit in intrusive
+// lists, so adding and cancelling are O(1); a coarse slot is spread over the
+// finer wheel once the root wheel wraps onto it.
+//
+// Deadlines are absolute steady_clock points, a timer never fires early and
+// periodic timers are rescheduled from their previous deadline, not from
+// when they ran, so they do not drift. Expired callbacks go to `pool`, or
+// run on the advancing thread when there is none.
+//
+// The wheel is driven either by its own thread (Start()) or by a reactor
+// that sleeps until NextExpiry() and calls Advance().
+class TimingWheel
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+    typedef uint64_t TimerId; // 0 is never a valid id
+
+    constexpr static TimerId INVALID_TIMER = 0;
+
+public:
+    explicit TimingWheel(ThreadPool * pool = nullptr, Clock::duration tick = std::chrono::milliseconds(1))
+        : _mx()
+          , _cv()
+          , _pool(pool)
+          , _tick(tick.count() > 0 ? tick : Clock::duration(1))
+          , _epoch(Clock::now())
+          , _current(0)
+          , _count(0)
+          , _nodes()
+          , _free(NIL)
+          , _heads()
+          , _driver()
+          , _running(false)
+          , _wakeAt(Clock::time_point::max())
+    {
+        _heads.fill(NIL);
+    }
+
+    TimingWheel(TimingWheel const &) = delete;
+    TimingWheel & operator=(TimingWheel const &) = delete;
+    ~TimingWheel() { Stop(); }
+
+    // Shared wheel with its own driver thread. Callbacks run on that thread,
+    // so they must only hand work off (post to a pool, resume a coroutine).
+    static TimingWheel & GetGlobalTimingWheel()
+    {
+        static TimingWheel wheel;
+        static std::once_flag started;
+        std::call_once(started, [] { wheel.Start(); });
+        return wheel;
+    }
+
+    TimerId RunAt(Clock::time_point deadline, std::function<void()> fn)
+    {
+        return Add(deadline, Clock::duration::zero(), std::move(fn));
+    }
+
+    template<typename Rep, typename Period>
+    TimerId RunAfter(std::chrono::duration<Rep, Period> delay, std::function<void()> fn)
+    {
+        return Add(Clock::now() + std::chrono::duration_cast<Clock::duration>(delay), Clock::duration::zero(), std::move(fn));
+    }
+
+    // First run one interval from now.
+    template<typename Rep, typename Period>
+    TimerId RunEvery(std::chrono::duration<Rep, Period> interval, std::function<void()> fn)
+    {
+        auto period = std::max(std::chrono::duration_cast<Clock::duration>(interval), _tick);
+        return Add(Clock::now() + period, period, std::move(fn));
+    }
+
+    // False if the timer already fired (one-shot) or was cancelled. A
+    // callback already handed to the pool still runs.
+    bool Cancel(TimerId id)
+    {
+        std::lock_guard<std::mutex> lk(_mx);
+        auto index = static_cast<uint32_t>(id);
+        if ( id == INVALID_TIMER || index >= _nodes.size() )
+            return false;
+        auto & node = _nodes[index];
+        if ( node.generation != static_cast<uint32_t>(id >> 32) || node.slot == NIL )
+            return false;
+        Unlink(index);
+        Release(index);
+        return true;
+    }
+
+    std::size_t Size() const
+    {
+        std::lock_guard<std::mutex> lk(_mx);
+        return _count;
+    }
+
+    // When Advance() next has something to do, Clock::time_point::max() if
+    // no timer is pending. May be early (a coarse wheel needs cascading),
+    // never late.
+    Clock::time_point NextExpiry() const
+    {
+        std::lock_guard<std::mutex> lk(_mx);
+        return NextExpiryLocked();
+    }
+
+    // Fires every timer due at `now`. Returns the number fired.
+    std::size_t Advance(Clock::time_point now = Clock::now())
+    {
+        std::vector<Task> due;
+        {
+            std::lock_guard<std::mutex> lk(_mx);
+            auto target = TickAt(now);
+            if ( _count == 0 && target > _current )
+                _current = target;
+            // Only occupied root slots and wrap points (cascades) need a
+            // visit, so a sparse wheel catches up in a few steps.
+            while ( _current < target && _count > 0 ) {
+                _current = std::min(NextTick(), target);
+                Cascade();
+                auto slot = static_cast<uint32_t>(_current & ROOT_MASK);
+                while ( _heads[slot] != NIL ) {
+                    auto index = _heads[slot];
+                    Unlink(index);
+                    Expire(index, now, due);
+                }
+            }
+            if ( _count == 0 && target > _current )
+                _current = target;
+        }
+        Dispatch(due);
+        return due.size();
+    }
+
+    // Drives the wheel from a dedicated thread until Stop().
+    void Start()
+    {
+        std::lock_guard<std::mutex> lk(_mx);
+        if ( _running )
+            return;
+        _running = true;
+        _driver = std::thread([this] { Drive(); });
+    }
+
+    void Stop()
+    {
+        {
+            std::lock_guard<std::mutex> lk(_mx);
+            if ( !_running )
+                return;
+            _running = false;
+        }
+        _cv.notify_all();
+        if ( _driver.joinable() && _driver.get_id() != std::this_thread::get_id() )
+            _driver.join();
+    }
+
+private:
+    constexpr static uint32_t NIL = ~0u;
+    constexpr static int ROOT_BITS = 8;
+    constexpr static int LEVEL_BITS = 6;
+    constexpr static int LEVELS = 3;
+    constexpr static uint64_t ROOT_SIZE = 1ull << ROOT_BITS;
+    constexpr static uint64_t ROOT_MASK = ROOT_SIZE - 1;
+    constexpr static uint64_t LEVEL_SIZE = 1ull << LEVEL_BITS;
+    constexpr static uint64_t LEVEL_MASK = LEVEL_SIZE - 1;
+    constexpr static uint64_t MAX_SPAN = 1ull << ( ROOT_BITS + LEVELS * LEVEL_BITS );
+
+    struct Node
+    {
+        Clock::time_point deadline;
+        Clock::duration interval; // zero for one-shot timers
+        uint64_t expires;         // deadline in ticks, rounded up
+        std::function<void()> fn;
+        uint32_t prev;
+        uint32_t next;
+        uint32_t slot;            // NIL when not in the wheel
+        uint32_t generation;
+    };
+
+    TimerId Add(Clock::time_point deadline, Clock::duration interval, std::function<void()> fn)
+    {
+        TimerId id;
+        bool wake;
+        {
+            std::lock_guard<std::mutex> lk(_mx);
+            uint32_t index;
+            if ( _free != NIL ) {
+                index = _free;
+                _free = _nodes[index].next;
+            } else {
+                index = static_cast<uint32_t>(_nodes.size());
+                _nodes.push_back({ {}, {}, 0, {}, NIL, NIL, NIL, 0 });
+            }
+            // An empty wheel is not advanced; catch up first so the next
+            // Advance() does not walk the idle spell.
+            if ( _count == 0 )
+                _current = std::max(_current, TickAt(Clock::now()));
+            auto & node = _nodes[index];
+            node.deadline = deadline;
+            node.interval = interval;
+            node.fn = std::move(fn);
+            node.expires = std::max(TickOf(deadline), _current + 1);
+            if ( ++node.generation == 0 )
+                ++node.generation;
+            ++_count;
+            Place(index);
+            id = ( static_cast<TimerId>(node.generation) << 32 ) | index;
+            wake = _running && deadline < _wakeAt;
+        }
+        if ( wake )
+            _cv.notify_all();
+        return id;
+    }
+
+    // The tick `now` falls in, rounded down.
+    uint64_t TickAt(Clock::time_point now) const
+    {
+        return now <= _epoch ? 0 : static_cast<uint64_t>(( now - _epoch ) / _tick);
+    }
+
+    uint64_t TickOf(Clock::time_point deadline) const
+    {
+        if ( deadline <= _epoch )
+            return 0;
+        auto ticks = ( deadline - _epoch + _tick - Clock::duration(1) ) / _tick;
+        return static_cast<uint64_t>(ticks);
+    }
+
+    void Place(uint32_t index)
+    {
+        auto & node = _nodes[index];
+        auto expires = std::max(node.expires, _current);
+        auto delta = expires - _current;
+        if ( delta >= MAX_SPAN ) {
+            // Parked in the top wheel and re-placed when it comes round.
+            expires = _current + MAX_SPAN - 1;
+            delta = MAX_SPAN - 1;
+        }
+        uint32_t slot;
+        if ( delta < ROOT_SIZE ) {
+            slot = static_cast<uint32_t>(expires & ROOT_MASK);
+        } else {
+            int level = 0;
+            while ( level < LEVELS - 1 && delta >= ( ROOT_SIZE << ( ( level + 1 ) * LEVEL_BITS ) ) )
+                ++level;
+            auto shift = ROOT_BITS + level * LEVEL_BITS;
+            slot = static_cast<uint32_t>(ROOT_SIZE + level * LEVEL_SIZE + ( ( expires >> shift ) & LEVEL_MASK ));
+        }
+        node.slot = slot;
+        node.prev = NIL;
+        node.next = _heads[slot];
+        if ( node.next != NIL )
+            _nodes[node.next].prev = index;
+        _heads[slot] = index;
+    }
+
+    void Unlink(uint32_t index)
+    {
+        auto & node = _nodes[index];
+        if ( node.prev != NIL )
+            _nodes[node.prev].next = node.next;
+        else
+            _heads[node.slot] = node.next;
+        if ( node.next != NIL )
+            _nodes[node.next].prev = node.prev;
+        node.slot = NIL;
+    }
+
+    void Release(uint32_t index)
+    {
+        auto & node = _nodes[index];
+        node.fn = nullptr;
+        node.next = _free;
+        _free = index;
+        --_count;
+    }
+
+    // Whenever a wheel wraps, the next slot of the wheel above is due to be
+    // spread out over the finer wheels.
+    void Cascade()
+    {
+        if ( ( _current & ROOT_MASK ) != 0 )
+            return;
+        for ( int level = 0; level < LEVELS; ++level ) {
+            auto shift = ROOT_BITS + level * LEVEL_BITS;
+            auto slot = static_cast<uint32_t>(ROOT_SIZE + level * LEVEL_SIZE + ( ( _current >> shift ) & LEVEL_MASK ));
+            auto index = _heads[slot];
+            _heads[slot] = NIL;
+            while ( index != NIL ) {
+                auto next = _nodes[index].next;
+                Place(index);
+                index = next;
+            }
+            if ( ( ( _current >> shift ) & LEVEL_MASK ) != 0 )
+                break;
+        }
+    }
+
+    void Expire(uint32_t index, Clock::time_point now, std::vector<Task> & due)
+    {
+        auto & node = _nodes[index];
+        if ( node.expires > _current ) {
+            Place(index);
+            return;
+        }
+        if ( node.interval == Clock::duration::zero() ) {
+            due.emplace_back(std::move(node.fn));
+            Release(index);
+            return;
+        }
+        due.emplace_back(node.fn);
+        node.deadline += node.interval;
+        // Behind by whole periods (a stalled driver): skip them rather than
+        // firing a burst.
+        if ( node.deadline <= now )
+            node.deadline += ( ( now - node.deadline ) / node.interval + 1 ) * node.interval;
+        node.expires = std::max(TickOf(node.deadline), _current + 1);
+        Place(index);
+    }
+
+    void Dispatch(std::vector<Task> & due)
+    {
+        if ( due.empty() )
+            return;
+        if ( _pool != nullptr )
+            _pool->EnqueueBatch(due);
+        for ( auto & task : due )
+            if ( task )
+                task();
+    }
+
+    Clock::time_point TimeOf(uint64_t tick) const { return _epoch + _tick * static_cast<Clock::rep>(tick); }
+
+    // The next occupied root slot before the root wheel wraps, else the
+    // wrap itself.
+    uint64_t NextTick() const
+    {
+        auto boundary = ( _current | ROOT_MASK ) + 1;
+        for ( auto tick = _current + 1; tick < boundary; ++tick )
+            if ( _heads[tick & ROOT_MASK] != NIL )
+                return tick;
+        return boundary;
+    }
+
+    Clock::time_point NextExpiryLocked() const
+    {
+        if ( _count == 0 )
+            return Clock::time_point::max();
+        return TimeOf(NextTick());
+    }
+
+    void Drive()
+    {
+        SetCurrentThreadName("timer");
+        std::unique_lock<std::mutex> lk(_mx);
+        while ( _running ) {
+            _wakeAt = NextExpiryLocked();
+            if ( _wakeAt == Clock::time_point::max() )
+                _cv.wait(lk);
+            else
+                _cv.wait_until(lk, _wakeAt);
+            if ( !_running )
+                break;
+            _wakeAt = Clock::time_point::min();
+            lk.unlock();
+            Advance();
+            lk.lock();
+        }
+        _wakeAt = Clock::time_point::max();
+    }
+
+private:
+    mutable std::mutex _mx;
+    std::condition_variable _cv;
+    ThreadPool * _pool;
+    Clock::duration const _tick;
+    Clock::time_point const _epoch;
+    uint64_t _current; // last tick processed
+    std::size_t _count;
+    std::vector<Node> _nodes;
+    uint32_t _free;
+    std::array<uint32_t, ROOT_SIZE + LEVELS * LEVEL_SIZE> _heads;
+    std::thread _driver;
+    bool _running;
+    Clock::time_point _wakeAt;
+};
+
+} // namespace threadpool
+} // namespace server
+
+#endif // !TIMINGWHEEL_H
@@ -0,0 +1,155 @@
+#ifndef WORKSTEALINGQUEUE_H
+#define WORKSTEALINGQUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+namespace server {
+namespace threadpool {
+
+// Per-worker deque (Chase-Lev, bounded). The owner pushes and pops at the
+// bottom (LIFO, cache warm) without a lock; thieves take from the top
+// (FIFO, oldest work first) with one CAS, and only race the owner for the
+// last item.
+//
+// A thief moves its item out after winning the CAS, so every cell carries
+// a sequence number, as in BoundedQueue: the owner reuses a cell only once
+// the previous item's taker has released it. A full deque refuses the push and
+// the caller queues the task elsewhere.
+template<typename T>
+class WorkStealingQueue
+{
+    constexpr static std::size_t CACHELINE = 64;
+
+    struct Cell
+    {
+        std::atomic<int64_t> sequence; // index the cell is free for
+        T data;
+    };
+
+public:
+    constexpr static std::size_t DEFAULT_CAPACITY = 1024;
+
+public:
+    explicit WorkStealingQueue(std::size_t capacity = DEFAULT_CAPACITY)
+        : _mask(RoundUp(capacity) - 1)
+          , _buffer(new Cell[_mask + 1])
+          , _top(0)
+          , _bottom(0)
+    {
+        for ( std::size_t i = 0; i <= _mask; ++i )
+            _buffer[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    WorkStealingQueue(WorkStealingQueue const &) = delete;
+    WorkStealingQueue & operator=(WorkStealingQueue const &) = delete;
+    ~WorkStealingQueue() = default;
+
+    // Owner only. Moves from `item` only when it was accepted.
+    bool Push(T & item)
+    {
+        auto b = _bottom.load(std::memory_order_relaxed);
+        auto & cell = _buffer[b & _mask];
+        if ( cell.sequence.load(std::memory_order_acquire) != b )
+            return false;
+        cell.data = std::move(item);
+        _bottom.store(b + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Owner only. Returns how many leading items were accepted.
+    template<typename It>
+    std::size_t PushBatch(It first, It last)
+    {
+        std::size_t count = 0;
+        for ( ; first != last && Push(*first); ++first )
+            ++count;
+        return count;
+    }
+
+    // Owner only.
+    bool Pop(T & item)
+    {
+        auto b = _bottom.load(std::memory_order_relaxed) - 1;
+        _bottom.store(b, std::memory_order_release);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto t = _top.load(std::memory_order_relaxed);
+        if ( t > b ) {
+            _bottom.store(b + 1, std::memory_order_release);
+            return false;
+        }
+        if ( t == b ) {
+            // Last item: whoever moves the top first gets it, and the cell
+            // is next used a lap later.
+            bool won = _top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+            _bottom.store(b + 1, std::memory_order_release);
+            if ( !won )
+                return false;
+            Take(b, b + Capacity(), item);
+            return true;
+        }
+        Take(b, b, item);
+        return true;
+    }
+
+    bool Steal(T & item)
+    {
+        auto t = _top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto b = _bottom.load(std::memory_order_acquire);
+        if ( t >= b )
+            return false;
+        if ( !_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed) )
+            return false;
+        Take(t, t + Capacity(), item);
+        return true;
+    }
+
+    // Approximate under concurrent use.
+    std::size_t Size() const
+    {
+        auto b = _bottom.load(std::memory_order_acquire);
+        auto t = _top.load(std::memory_order_acquire);
+        return b > t ? b - t : 0;
+    }
+
+    // Owner only, or once no thread uses the deque any more.
+    void Clear()
+    {
+        T item;
+        while ( Pop(item) ) ;
+    }
+
+private:
+    // Moves the item at `index` out and frees its cell for index `next`.
+    void Take(int64_t index, int64_t next, T & item)
+    {
+        auto & cell = _buffer[index & _mask];
+        item = std::move(cell.data);
+        cell.sequence.store(next, std::memory_order_release);
+    }
+
+    int64_t Capacity() const { return static_cast<int64_t>(_mask) + 1; }
+
+    static std::size_t RoundUp(std::size_t n)
+    {
+        std::size_t size = 2;
+        while ( size < n )
+            size <<= 1;
+        return size;
+    }
+
+private:
+    std::size_t const _mask;
+    std::unique_ptr<Cell[]> const _buffer;
+    alignas(CACHELINE) std::atomic<int64_t> _top;
+    alignas(CACHELINE) std::atomic<int64_t> _bottom;
+};
+
+} // namespace threadpool
+} // namespace server
+
+#endif // !WORKSTEALINGQUEUE_H